@@ -0,0 +1,48 @@
+# Parser churn of a connect storm: N clients log in at once, each one parsing
+# the three stream documents of a login (initial, after STARTTLS, after SASL),
+# then all of them drop and reconnect.
+#
+#   ruby bench/connect_storm.rb [clients] [storms]
+#
+# Without reuse every login created three expat parsers.
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require 'benchmark'
+
+clients = (ARGV[0] || 1000).to_i
+storms = (ARGV[1] || 5).to_i
+
+header = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' " \
+         "from='example.com' id='%d' version='1.0'>"
+features = ["<stream:features><starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/></stream:features>" \
+            "<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>",
+            "<stream:features><mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+            "<mechanism>PLAIN</mechanism></mechanisms></stream:features>" \
+            "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>",
+            "<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/></stream:features>" \
+            "<iq type='result' id='bind_1'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>" \
+            "<jid>user@example.com/bench</jid></bind></iq>"]
+
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+
+storms.times do |storm|
+  before = ctx.parser_pool_stats
+  parsers = nil
+  time = Benchmark.realtime do
+    parsers = Array.new(clients) { StropheRuby::StreamParser.new(ctx) }
+    features.each do |doc|
+      parsers.each_with_index do |parser, i|
+        parser.reset
+        parser.feed(header % i)
+        parser.feed(doc)
+      end
+    end
+  end
+  parsers = nil
+  GC.start
+
+  after = ctx.parser_pool_stats
+  printf("storm %d: %6.1f us/login, parsers created %5d (was %d), reused %5d, reset in place %5d\n",
+         storm, time * 1e6 / clients, after[:created] - before[:created], clients * features.size,
+         after[:reused] - before[:reused], after[:resets] - before[:resets])
+end
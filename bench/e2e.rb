@@ -0,0 +1,177 @@
+# End to end numbers through real sockets: the binding logs into
+# bench/support/mock_server.rb, started as a separate process, and runs
+#
+#   echo     one client keeping BENCH_WINDOW messages in flight, echoed back
+#   fanout   BENCH_CLIENTS clients in a room, every message reaches all of them
+#   iq       one client pipelining BENCH_WINDOW iq gets
+#   flood    the server pushes BENCH_MESSAGES messages at one client
+#
+# For each it reports messages/s, p50/p99 round trip (none for flood), CPU time
+# and Ruby objects allocated per message received, as JSON on stdout or into
+# the file given.
+#
+#   ruby bench/e2e.rb [results.json]
+#   rake bench BENCH_OUT=results.json BENCH_MESSAGES=50000
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require File.dirname(__FILE__) + '/support/mock_server'
+require 'json'
+
+MESSAGES = (ENV['BENCH_MESSAGES'] || 20_000).to_i
+WINDOW = (ENV['BENCH_WINDOW'] || 64).to_i
+CLIENTS = (ENV['BENCH_CLIENTS'] || 10).to_i
+TIMEOUT = 120
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def cpu
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+# run the event loop until the block is true
+def pump(ctx)
+  deadline = now + TIMEOUT
+  until yield
+    raise "timed out" if now > deadline
+    # the last connection going down stops the loop, keep it going for the next login
+    ctx.loop_status = 1 if ctx.loop_status == 2
+    StropheRuby::EventLoop.run_once(ctx, 1)
+  end
+end
+
+# connections that are logged in
+UP = {}.compare_by_identity
+
+def login(ctx, port, user)
+  conn = StropheRuby::Connection.new(ctx)
+  conn.jid = "#{user}@localhost/bench"
+  conn.password = "secret"
+  conn.connect("127.0.0.1", port) { |status| UP[conn] = status == StropheRuby::ConnectionEvents::CONNECT }
+  pump(ctx) { UP[conn] }
+  conn
+end
+
+# log out once a scenario is done, so its clients don't take part in the next one
+def logout(ctx, *conns)
+  conns.each(&:disconnect)
+  pump(ctx) { conns.none? { |conn| UP[conn] } }
+end
+
+def message(ctx, to, id, body)
+  msg = StropheRuby::Stanza.new(ctx)
+  msg.name = "message"
+  msg.type = "chat"
+  msg.id = id
+  msg.set_attribute("to", to)
+  element = StropheRuby::Stanza.new(ctx)
+  element.name = "body"
+  text = StropheRuby::Stanza.new(ctx)
+  text.text = body
+  element.add_child(text)
+  msg.add_child(element)
+  msg
+end
+
+def iq(ctx, id)
+  iq = StropheRuby::Stanza.new(ctx)
+  iq.name = "iq"
+  iq.type = "get"
+  iq.id = id
+  iq.set_attribute("to", "localhost")
+  query = StropheRuby::Stanza.new(ctx)
+  query.name = "query"
+  query.ns = "jabber:iq:version"
+  iq.add_child(query)
+  iq
+end
+
+def percentile(sorted, q)
+  return nil if sorted.empty?
+  (sorted[[(q * sorted.size).ceil - 1, 0].max] * 1e6).round(1)
+end
+
+# the block runs a scenario and returns [messages received, round trips in seconds]
+def measure(name)
+  GC.start
+  allocated, cpu_before, started = GC.stat(:total_allocated_objects), cpu, now
+  received, rtts = yield
+  seconds, cpu_used = now - started, cpu - cpu_before
+  allocated = GC.stat(:total_allocated_objects) - allocated
+  rtts = rtts.sort
+  { scenario: name, messages: received, seconds: seconds.round(4),
+    msgs_per_sec: (received / seconds).round(1),
+    rtt_p50_us: percentile(rtts, 0.50), rtt_p99_us: percentile(rtts, 0.99),
+    cpu_us_per_msg: (cpu_used * 1e6 / received).round(2),
+    allocs_per_msg: (allocated.to_f / received).round(2) }
+end
+
+# send count stanzas built by make(id), at most WINDOW waiting for their answer
+# at a time; handlers call done(id) once per answer. expect answers per stanza
+class Window
+  attr_reader :rtts, :received
+
+  def initialize(ctx, count, expect = 1, &make)
+    @ctx, @count, @expect, @make = ctx, count, expect, make
+    @sent_at, @pending, @rtts, @received, @next = {}, Hash.new(0), [], 0, 0
+  end
+
+  def done(id)
+    at = @sent_at[id] or return
+    @rtts << now - at
+    @received += 1
+    @sent_at.delete(id) if (@pending[id] += 1) == @expect
+  end
+
+  def run(conn)
+    pump(@ctx) do
+      while @next < @count && @sent_at.size < WINDOW
+        id = "b#{@next += 1}"
+        @sent_at[id] = now
+        conn.send(@make.call(id))
+      end
+      @next == @count && @sent_at.empty?
+    end
+    [@received, @rtts]
+  end
+end
+
+port, server = MockServer.spawn
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+results = []
+
+echo = login(ctx, port, "echo")
+echo_window = Window.new(ctx, MESSAGES) { |id| message(ctx, "bot@localhost", id, "hello #{id}") }
+echo.add_handler("message") { |msg| echo_window.done(msg.id) }
+results << measure("echo") { echo_window.run(echo) }
+logout(ctx, echo)
+
+members = Array.new(CLIENTS) { |i| login(ctx, port, "member#{i}") }
+room_window = Window.new(ctx, MESSAGES / CLIENTS, CLIENTS) { |id| message(ctx, "room@localhost", id, "to all #{id}") }
+members.each { |member| member.add_handler("message") { |msg| room_window.done(msg.id) } }
+results << measure("fanout") { room_window.run(members.first) }
+logout(ctx, *members)
+
+asker = login(ctx, port, "iq")
+iq_window = Window.new(ctx, MESSAGES) { |id| iq(ctx, id) }
+asker.add_handler("iq") { |reply| iq_window.done(reply.id) }
+results << measure("iq") { iq_window.run(asker) }
+logout(ctx, asker)
+
+flooded = login(ctx, port, "flood")
+received = 0
+flooded.add_handler("message") { |msg| received += 1 }
+results << measure("flood") do
+  flooded.send(message(ctx, "flood@localhost", "flood", MESSAGES.to_s))
+  pump(ctx) { received == MESSAGES }
+  [received, []]
+end
+logout(ctx, flooded)
+
+server.close
+report = JSON.pretty_generate(ruby: RUBY_VERSION, binding: StropheRuby::VERSION,
+                              messages: MESSAGES, window: WINDOW, clients: CLIENTS,
+                              time: Time.now.utc.strftime("%Y-%m-%dT%H:%M:%SZ"), results: results)
+out = ARGV[0] || ENV['BENCH_OUT']
+out ? File.write(out, report + "\n") : puts(report)
@@ -0,0 +1,27 @@
+# Throughput of the XML escape kernels and of Stanza#to_s on large bodies.
+#
+#   ruby bench/escape.rb [body_kb]
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require 'benchmark'
+
+body_kb = (ARGV[0] || 64).to_i
+chunk = %q{{"id": 42, "code": "if (a < b && c > d) { puts \"x\" }"} } + "plain text " * 8
+body = (chunk * (body_kb * 1024 / chunk.size + 1))[0, body_kb * 1024]
+rounds = [1, 64 * 1024 * 1024 / body.size].max
+
+puts "body #{body_kb} KB, #{rounds} rounds"
+StropheRuby::XML.kernels.each do |kernel|
+  secs = Benchmark.realtime { rounds.times { StropheRuby::XML.escape(body, :kernel => kernel) } }
+  printf("escape %-7s %8.1f MB/s\n", kernel, body.size * rounds / secs / 1_048_576)
+end
+
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+StropheRuby::Connection.new(ctx)
+message = StropheRuby::Stanza.new
+message.name = "message"
+text = StropheRuby::Stanza.new
+text.text = body
+message.add_child(text)
+secs = Benchmark.realtime { rounds.times { message.to_s } }
+printf("to_s           %8.1f MB/s\n", body.size * rounds / secs / 1_048_576)
@@ -0,0 +1,28 @@
+# Parse a message with a large body arriving in socket-sized reads.
+#
+#   ruby bench/parser_text.rb [body_mb] [read_kb]
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require 'benchmark'
+
+body_mb = (ARGV[0] || 1).to_f
+read_kb = (ARGV[1] || 4).to_i
+rounds = 20
+
+body = ["x" * 57].pack("m").delete("\n") * (body_mb * 1_048_576 / 76).to_i
+xml = "<message from='a@example.com' to='b@example.com'><body>#{body}</body></message>"
+chunks = xml.scan(/.{1,#{read_kb * 1024}}/m)
+
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+conn = StropheRuby::Connection.new(ctx)
+received = 0
+conn.add_handler("message") { |msg| received += msg.child_by_name("body").text.size }
+conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+
+secs = Benchmark.realtime do
+  rounds.times { chunks.each { |chunk| conn.feed(chunk) } }
+end
+
+raise "body lost (#{received} bytes)" unless received == body.size * rounds
+printf("%.1f MB body in %d KB reads: %.2f ms/message, %.1f MB/s\n",
+       body.size / 1_048_576.0, read_kb, secs * 1000 / rounds, body.size * rounds / secs / 1_048_576)
@@ -0,0 +1,32 @@
+# Compare tree handlers with raw passthrough handlers on an archival workload.
+#
+#   ruby bench/raw_passthrough.rb [stanzas]
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require 'benchmark'
+
+count = (ARGV[0] || 50_000).to_i
+stanza = "<message from='alice@example.com/home' to='bob@example.com' type='chat' id='m1'>" \
+         "<body>see you at 5</body><active xmlns='http://jabber.org/protocol/chatstates'/>" \
+         "<x xmlns='jabber:x:event'><composing/></x></message>"
+stream = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+data = (stanza * count).scan(/.{1,4096}/m)
+
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+
+def run(ctx, stream, data, raw)
+  conn = StropheRuby::Connection.new(ctx)
+  archived = 0
+  if raw
+    conn.add_handler("message", :raw => true) { |msg| archived += msg.xml.size }
+  else
+    conn.add_handler("message") { |msg| archived += msg.to_s.size }
+  end
+  conn.feed(stream)
+  Benchmark.realtime { data.each { |chunk| conn.feed(chunk) } }
+end
+
+tree = run(ctx, stream, data, false)
+raw = run(ctx, stream, data, true)
+printf("tree %8.0f stanzas/s\n", count / tree)
+printf("raw  %8.0f stanzas/s (%.1fx)\n", count / raw, tree / raw)
@@ -0,0 +1,192 @@
+# Soak test: a mixed workload against bench/support/mock_server.rb for hours,
+# sampling once a second what grows when something leaks. Catches slow leaks
+# a benchmark run is too short for, eg. text buffers never freed or handlers
+# piling up.
+#
+#   ruby bench/soak.rb [seconds] [samples.csv]
+#   rake bench:soak SOAK_DURATION=14400 SOAK_CSV=soak.csv
+#
+# SOAK_CLIENTS connections (10) share SOAK_RATE stanzas/s (200): echoed chat
+# messages of random sizes, room messages fanned out to everyone, iq gets and
+# presence, with the replies read, serialized and reparsed like an application
+# would. One client reconnects every SOAK_RECONNECT seconds (30).
+#
+# Each second adds a row to the CSV. At the end the growth of every column is
+# fitted with least squares, leaving out the first SOAK_WARMUP seconds (60)
+# while caches fill, and compared with its limit per hour, SOAK_MAX_<COLUMN>
+# to change one, eg. SOAK_MAX_RSS_KB=20480. The exit status is 1 if any grew
+# faster.
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require File.dirname(__FILE__) + '/support/mock_server'
+
+DURATION = (ARGV[0] || ENV['SOAK_DURATION'] || 3600).to_f
+CSV_PATH = ARGV[1] || ENV['SOAK_CSV'] || "soak.csv"
+CLIENTS = (ENV['SOAK_CLIENTS'] || 10).to_i
+RATE = (ENV['SOAK_RATE'] || 200).to_f
+RECONNECT = (ENV['SOAK_RECONNECT'] || 30).to_f
+WARMUP = (ENV['SOAK_WARMUP'] || 60).to_f
+
+# growth allowed per hour, by column
+LIMITS = {
+  rss_kb: 10_240, heap_live_slots: 50_000, native_bytes: 1_048_576, live_stanzas: 100,
+  stanza_wrappers: 100, send_queue_bytes: 65_536, handlers: 1
+}.map { |column, limit| [column, (ENV["SOAK_MAX_#{column.upcase}"] || limit).to_f] }.to_h
+COLUMNS = %i[seconds rss_kb heap_live_slots gc_count major_gc_count native_bytes live_stanzas
+             stanza_wrappers send_queue_bytes handlers sent received]
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def rss_kb
+  File.read("/proc/self/status")[/^VmRSS:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  `ps -o rss= -p #{$$}`.to_i
+end
+
+def element(ctx, name, text = nil)
+  stanza = StropheRuby::Stanza.new(ctx)
+  stanza.name = name
+  if text
+    node = StropheRuby::Stanza.new(ctx)
+    node.text = text
+    stanza.add_child(node)
+  end
+  stanza
+end
+
+# the stanza for turn n of the mix
+def stanza(ctx, n)
+  case n % 20
+  when 0
+    msg = element(ctx, "message")
+    msg.set_attribute("to", "room@localhost")
+    msg.add_child(element(ctx, "body", "everyone #{n}"))
+    msg
+  when 1, 2, 3
+    iq = element(ctx, "iq")
+    iq.type = "get"
+    iq.id = "q#{n}"
+    iq.set_attribute("to", "localhost")
+    query = element(ctx, "query")
+    query.ns = "jabber:iq:version"
+    iq.add_child(query)
+    iq
+  when 4
+    presence = element(ctx, "presence")
+    presence.add_child(element(ctx, "status", "soaking #{n}"))
+    presence
+  else
+    msg = element(ctx, "message")
+    msg.type = "chat"
+    msg.id = "m#{n}"
+    msg.set_attribute("to", "echo@localhost")
+    msg.add_child(element(ctx, "body", "x" * rand(2048)))
+    msg
+  end
+end
+
+class SoakClient
+  attr_reader :conn
+
+  def initialize(ctx, port, user, counts)
+    @conn = StropheRuby::Connection.new(ctx)
+    @conn.jid = "#{user}@localhost/soak"
+    @conn.password = "secret"
+    @up = false
+    @conn.add_handler("message") do |msg|
+      counts[:received] += 1
+      body = msg.child_by_name("body")
+      body.text if body
+      StropheRuby::Stanza.parse(msg.to_s, ctx) if counts[:received] % 25 == 0
+    end
+    @conn.add_handler("iq") do |iq|
+      counts[:received] += 1
+      iq.attributes
+    end
+    @conn.connect("127.0.0.1", port) { |status| @up = status == StropheRuby::ConnectionEvents::CONNECT }
+  end
+
+  def up?
+    @up
+  end
+end
+
+def sample(ctx, clients, started, counts)
+  gc = GC.stat
+  memory = ctx.memory_stats
+  { seconds: (now - started).round(1), rss_kb: rss_kb, heap_live_slots: gc[:heap_live_slots],
+    gc_count: gc[:count], major_gc_count: gc[:major_gc_count], native_bytes: memory[:bytes],
+    live_stanzas: memory[:live_stanzas], stanza_wrappers: memory[:stanza_wrappers],
+    send_queue_bytes: memory[:connections].sum { |conn| conn[:send_queue_bytes] },
+    handlers: clients.sum { |client| client.conn.handler_stats.size },
+    sent: counts[:sent], received: counts[:received] }
+end
+
+# least squares slope of ys against xs
+def slope(xs, ys)
+  mx, my = xs.sum / xs.size, ys.sum.to_f / ys.size
+  den = xs.sum { |x| (x - mx)**2 }
+  den.zero? ? 0.0 : xs.zip(ys).sum { |x, y| (x - mx) * (y - my) } / den
+end
+
+port, server = MockServer.spawn
+StropheRuby::EventLoop.prepare
+ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+counts = Hash.new(0)
+clients = Array.new(CLIENTS) { |i| SoakClient.new(ctx, port, "soak#{i}", counts) }
+rows = []
+csv = File.open(CSV_PATH, "w")
+csv.puts COLUMNS.join(",")
+
+started = now
+next_sample = started + 1
+next_send = started
+next_reconnect = started + RECONNECT
+reconnects = 0
+turn = 0
+until (t = now) - started >= DURATION
+  # a turn falling on a client that is logging in is skipped
+  while next_send <= t
+    client = clients[turn % CLIENTS]
+    if client.up?
+      client.conn.send(stanza(ctx, turn))
+      counts[:sent] += 1
+    end
+    turn += 1
+    next_send += 1 / RATE
+  end
+  if t >= next_reconnect
+    i = reconnects % CLIENTS
+    clients[i].conn.disconnect
+    clients[i] = SoakClient.new(ctx, port, "soak#{i}", counts)
+    reconnects += 1
+    next_reconnect += RECONNECT
+  end
+  if t >= next_sample
+    rows << sample(ctx, clients, started, counts)
+    csv.puts rows.last.values_at(*COLUMNS).join(",")
+    csv.flush
+    next_sample += 1
+  end
+  ctx.loop_status = 1 if ctx.loop_status == 2
+  StropheRuby::EventLoop.run_once(ctx, 1)
+end
+csv.close
+server.close
+
+abort "no samples, run for a second at least" if rows.empty?
+steady = rows.select { |row| row[:seconds] >= WARMUP }
+steady = rows if steady.size < 2
+xs = steady.map { |row| row[:seconds] }
+failed = []
+printf("%.0fs, %d stanzas sent, %d received, %d reconnects, samples in %s\n",
+       DURATION, counts[:sent], counts[:received], reconnects, CSV_PATH)
+printf("%-18s %14s %14s %14s %14s\n", "", "start", "end", "growth/hour", "limit/hour")
+LIMITS.each do |column, limit|
+  per_hour = slope(xs, steady.map { |row| row[column] }) * 3600
+  failed << column if per_hour > limit
+  printf("%-18s %14d %14d %14.1f %14.1f %s\n", column, steady.first[column], steady.last[column],
+         per_hour, limit, per_hour > limit ? "LEAKING" : "ok")
+end
+exit(failed.empty? ? 0 : 1)
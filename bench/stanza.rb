@@ -0,0 +1,145 @@
+# frozen_string_literal: true
+#
+# Cost of the per-stanza calls, one at a time and in typical combinations:
+# ns/op, Ruby objects allocated/op (GC.stat) and native allocations/op (the
+# context's allocator, memory_stats[:allocations]).
+#
+#   ruby bench/stanza.rb [operation ...]
+#   rake bench:stanza BENCH_SAVE=base.json      # keep the samples as a baseline
+#   rake bench:stanza BENCH_BASELINE=base.json  # and compare against it later
+#
+# Every operation is warmed up, then timed over BENCH_RUNS runs of
+# BENCH_ITERATIONS calls. Against a baseline the run times are compared with
+# Welch's t-test: a change is reported when it is significant (|t| > 3) and
+# over BENCH_THRESHOLD percent. Allocation counts are exact, any increase is
+# reported. The exit status is 1 when something got worse.
+require File.dirname(__FILE__) + '/../lib/strophe_ruby'
+require 'json'
+
+RUNS = (ENV['BENCH_RUNS'] || 10).to_i
+ITERATIONS = (ENV['BENCH_ITERATIONS'] || 20_000).to_i
+THRESHOLD = (ENV['BENCH_THRESHOLD'] || 5).to_f
+
+StropheRuby::EventLoop.prepare
+CTX = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+
+def element(name, text = nil)
+  stanza = StropheRuby::Stanza.new(CTX)
+  stanza.name = name
+  if text
+    node = StropheRuby::Stanza.new(CTX)
+    node.text = text
+    stanza.add_child(node)
+  end
+  stanza
+end
+
+MESSAGE_XML = "<message to='bot@example.com/bench' from='alice@example.com/phone' type='chat' id='m42'>" \
+              "<body>Hello there, how are you doing today?</body>" \
+              "<active xmlns='http://jabber.org/protocol/chatstates'/></message>"
+MESSAGE = StropheRuby::Stanza.parse(MESSAGE_XML, CTX)
+BODY = MESSAGE.child_by_name("body")
+TARGET = element("message")
+CHILD = element("body", "hi")
+
+OPERATIONS = {
+  "Stanza.new" => -> { StropheRuby::Stanza.new(CTX) },
+  "set_attribute" => -> { TARGET.set_attribute("to", "bob@example.com") },
+  # into a new parent each time, subtract "Stanza.new" for the call itself
+  "add_child" => -> { StropheRuby::Stanza.new(CTX).add_child(CHILD) },
+  "to_s" => -> { MESSAGE.to_s },
+  "attribute" => -> { MESSAGE.attribute("from") },
+  "child_by_name" => -> { MESSAGE.child_by_name("body") },
+  "text" => -> { BODY.text },
+  # what an echo bot does with every message
+  "echo reply" => lambda {
+    reply = element("message")
+    reply.type = MESSAGE.type
+    reply.id = MESSAGE.id
+    reply.set_attribute("to", MESSAGE.attribute("from"))
+    reply.set_attribute("from", MESSAGE.attribute("to"))
+    reply.add_child(element("body", MESSAGE.child_by_name("body").text))
+    reply.to_s
+  },
+  "read message" => lambda {
+    MESSAGE.values_at("from", "type", "id")
+    MESSAGE.child_by_name("body").text
+  },
+  "parse message" => -> { StropheRuby::Stanza.parse(MESSAGE_XML, CTX) }
+}
+
+def native_allocations
+  CTX.memory_stats[:allocations]
+end
+
+# [ns/op of each run, objects/op, native allocations/op]
+def measure(op)
+  (ITERATIONS / 10).times { op.call }
+  times, objects, mallocs = [], [], []
+  RUNS.times do
+    GC.start
+    native = native_allocations
+    allocated = GC.stat(:total_allocated_objects)
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    i = 0
+    while i < ITERATIONS
+      op.call
+      i += 1
+    end
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - started
+    objects << GC.stat(:total_allocated_objects) - allocated
+    mallocs << native_allocations - native
+    times << elapsed.to_f / ITERATIONS
+  end
+  [times, objects.min.to_f / ITERATIONS, mallocs.min.to_f / ITERATIONS]
+end
+
+def mean(xs)
+  xs.sum / xs.size
+end
+
+def variance(xs)
+  m = mean(xs)
+  xs.sum { |x| (x - m)**2 } / [xs.size - 1, 1].max
+end
+
+def median(xs)
+  sorted = xs.sort
+  (sorted[(sorted.size - 1) / 2] + sorted[sorted.size / 2]) / 2
+end
+
+# Welch's t statistic of b against a, positive when b is slower
+def welch(a, b)
+  se = Math.sqrt(variance(a) / a.size + variance(b) / b.size)
+  se.zero? ? 0.0 : (mean(b) - mean(a)) / se
+end
+
+def compare(name, result, before)
+  return "" unless before
+  change = (median(result[:ns]) / median(before["ns"]) - 1) * 100
+  t = welch(before["ns"], result[:ns])
+  notes = []
+  notes << (change > 0 ? "slower" : "faster") if t.abs > 3 && change.abs > THRESHOLD
+  notes << "more objects" if result[:objects] > before["objects"]
+  notes << "more mallocs" if result[:mallocs] > before["mallocs"]
+  $worse = true if notes.include?("slower") || notes.any? { |note| note.start_with?("more") }
+  format("%+7.1f%% t=%6.1f %s", change, t, notes.join(", "))
+end
+
+names = ARGV.empty? ? OPERATIONS.keys : ARGV
+unknown = names - OPERATIONS.keys
+abort "unknown operation #{unknown.join(', ')}, one of: #{OPERATIONS.keys.join(', ')}" unless unknown.empty?
+baseline = ENV['BENCH_BASELINE'] && JSON.parse(File.read(ENV['BENCH_BASELINE']))
+results = {}
+
+printf("%-16s %10s %8s %10s %8s  %s\n", "operation", "ns/op", "+/-", "objects/op", "malloc/op",
+       baseline ? "vs baseline" : "")
+names.each do |name|
+  ns, objects, mallocs = measure(OPERATIONS[name])
+  results[name] = { ns: ns, objects: objects, mallocs: mallocs }
+  printf("%-16s %10.1f %8.1f %10.2f %8.2f  %s\n", name, median(ns), Math.sqrt(variance(ns)),
+         objects, mallocs, compare(name, results[name], baseline && baseline[name]))
+end
+
+File.write(ENV['BENCH_SAVE'], JSON.pretty_generate(results) + "\n") if ENV['BENCH_SAVE']
+exit 1 if $worse
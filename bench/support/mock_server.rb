@@ -0,0 +1,248 @@
+# A local stand-in for an XMPP server, just enough for xmpp_connect_client
+# and the benchmarks: no TLS, SASL PLAIN accepting any password, resource
+# binding and sessions. Once a client is bound it behaves as follows:
+#
+#   <message to='flood@localhost'><body>N</body></message>
+#       the server sends N messages to the client as fast as it can
+#   <message to='room@localhost'>...</message>
+#       a copy goes to every bound client, the sender included
+#   any other <message>
+#       is echoed back to the sender, to and from swapped
+#   <iq type='get'/'set'>
+#       gets an empty result with the same id
+#
+# Run it in its own process, MockServer.spawn or
+#
+#   ruby bench/support/mock_server.rb [port]
+#
+# as the event loop keeps the GVL while it waits on its sockets. It prints
+# "ready <port>" once listening (port 0 picks a free one) and runs until stdin
+# is closed.
+require 'rbconfig'
+require 'socket'
+
+class MockServer
+  STREAM_NS = "xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'"
+  DOMAIN = "localhost"
+
+  # Pulls toplevel elements out of the bytes a client sent. Good for what
+  # libstrophe writes: no '<' or '>' in attribute values, no CDATA.
+  class Splitter
+    TAG = /<(\/?)([^\s>\/?!]+)[^>]*?(\/?)>/
+
+    def initialize
+      @buf = +""
+      @depth = 0
+      @start = nil
+      @pos = 0
+    end
+
+    # yields [:stream, header] for stream headers, [:close, tag] when the stream
+    # ends and [:stanza, xml] for stanzas
+    def feed(data)
+      @buf << data
+      while (m = TAG.match(@buf, @pos))
+        @pos = m.end(0)
+        closing, name, empty = m[1] == "/", m[2], m[3] == "/"
+        if name == "stream:stream"
+          @depth = closing ? 0 : 1
+          yield closing ? :close : :stream, m[0]
+          compact
+        elsif closing
+          @depth -= 1
+          finish { |xml| yield :stanza, xml } if @depth == 1
+        else
+          @start = m.begin(0) if @depth == 1
+          if empty
+            finish { |xml| yield :stanza, xml } if @depth == 1
+          else
+            @depth += 1
+          end
+        end
+      end
+    end
+
+    private
+
+    def finish
+      yield @buf[@start...@pos]
+      compact
+    end
+
+    def compact
+      @buf = @buf[@pos..-1]
+      @pos = 0
+      @start = nil
+    end
+  end
+
+  class Client
+    attr_accessor :jid, :bound
+    attr_reader :socket, :splitter, :out
+
+    def initialize(socket)
+      @socket = socket
+      @splitter = Splitter.new
+      @out = +""
+      @bound = false
+    end
+  end
+
+  def initialize(port = 0)
+    @server = TCPServer.new("127.0.0.1", port)
+    @clients = {}
+    @stream_ids = 0
+  end
+
+  # start a server in a child process, [port, io]. Closing io stops it
+  def self.spawn(port = 0)
+    io = IO.popen([RbConfig.ruby, __FILE__, port.to_s], "r+")
+    ready = io.gets or raise "mock server did not start"
+    [ready.split.last.to_i, io]
+  end
+
+  def port
+    @server.addr[1]
+  end
+
+  def run(control = nil)
+    loop do
+      readers = [@server] + @clients.keys
+      readers << control if control
+      writers = @clients.values.reject { |c| c.out.empty? }.map(&:socket)
+      ready, writable = IO.select(readers, writers)
+      writable.each { |socket| flush(@clients[socket]) }
+      ready.each do |io|
+        if io == @server
+          socket = @server.accept
+          socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+          @clients[socket] = Client.new(socket)
+        elsif io == control
+          return if io.read_nonblock(4096, exception: false).nil?
+        else
+          read(@clients[io])
+        end
+      end
+    end
+  ensure
+    @clients.each_key(&:close)
+    @server.close
+  end
+
+  private
+
+  def read(client)
+    data = client.socket.read_nonblock(65536, exception: false)
+    return if data == :wait_readable
+    return drop(client) if data.nil?
+    client.splitter.feed(data) do |kind, xml|
+      case kind
+      when :stream then open_stream(client)
+      when :close then close_stream(client)
+      else stanza(client, xml)
+      end
+    end
+    flush(client)
+  rescue Errno::ECONNRESET, Errno::EPIPE
+    drop(client)
+  end
+
+  def drop(client)
+    @clients.delete(client.socket)
+    client.socket.close
+  end
+
+  def queue(client, xml)
+    client.out << xml
+    flush(client) if client.out.bytesize > 65536
+  end
+
+  def flush(client)
+    return if client.nil? || client.out.empty? || client.socket.closed?
+    written = client.socket.write_nonblock(client.out, exception: false)
+    client.out.slice!(0, written) if written.is_a?(Integer)
+  rescue Errno::ECONNRESET, Errno::EPIPE
+    drop(client)
+  end
+
+  def open_stream(client)
+    queue(client, "<?xml version='1.0'?><stream:stream #{STREAM_NS} id='s#{@stream_ids += 1}' " \
+                 "from='#{DOMAIN}' version='1.0'>")
+    if client.jid
+      queue(client, "<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>" \
+                   "<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/></stream:features>")
+    else
+      queue(client, "<stream:features><mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>" \
+                   "<mechanism>PLAIN</mechanism></mechanisms></stream:features>")
+    end
+  end
+
+  # the client leaves: answer its stream end and hang up, it gets no more room copies
+  def close_stream(client)
+    return if client.socket.closed?
+    queue(client, "</stream:stream>")
+    flush(client)
+    drop(client)
+  end
+
+  def stanza(client, xml)
+    case xml
+    when /\A<auth /
+      user = xml[/>([^<]*)</, 1].to_s.unpack("m").first.to_s.split("\0")[1] || "user"
+      client.jid = "#{user}@#{DOMAIN}"
+      queue(client, "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>")
+    when /\A<iq /
+      iq(client, xml)
+    when /\A<message /
+      message(client, xml)
+    end
+  end
+
+  def iq(client, xml)
+    id = attribute(xml, "id")
+    if xml.include?("urn:ietf:params:xml:ns:xmpp-bind")
+      resource = xml[/<resource>([^<]*)</, 1] || "bench"
+      client.jid = "#{client.jid.split('/').first}/#{resource}"
+      client.bound = true
+      queue(client, "<iq type='result' id='#{id}'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'>" \
+                   "<jid>#{client.jid}</jid></bind></iq>")
+    else
+      queue(client, "<iq type='result' id='#{id}' from='#{DOMAIN}' to='#{client.jid}'/>")
+    end
+  end
+
+  def message(client, xml)
+    to = attribute(xml, "to").to_s
+    case to
+    when "flood@#{DOMAIN}"
+      count = xml[/<body>(\d+)</, 1].to_i
+      count.times do |i|
+        queue(client, "<message from='flood@#{DOMAIN}' to='#{client.jid}' id='f#{i}'><body>flood #{i}</body></message>")
+      end
+    when "room@#{DOMAIN}"
+      copy = address(xml, "room@#{DOMAIN}", "room@#{DOMAIN}/#{client.jid[/\A[^@]*/]}")
+      @clients.each_value { |other| queue(other, copy) if other.bound }
+    else
+      queue(client, address(xml, client.jid, to))
+    end
+  end
+
+  # libstrophe quotes attributes with ", the benchmarks with '
+  def attribute(xml, name)
+    xml[/\A<[^>]*? #{name}=(['"])(.*?)\1/, 2]
+  end
+
+  # xml with its to and from replaced
+  def address(xml, to, from)
+    head = xml[/\A<[^>]*>/]
+    rest = xml[head.length..-1]
+    head.gsub(/ (?:to|from)=(['"]).*?\1/, "").sub(/\A<[^\s\/>]+/) { |tag| "#{tag} to='#{to}' from='#{from}'" } + rest
+  end
+end
+
+if $0 == __FILE__
+  server = MockServer.new((ARGV[0] || 0).to_i)
+  $stdout.puts "ready #{server.port}"
+  $stdout.flush
+  server.run($stdin)
+end
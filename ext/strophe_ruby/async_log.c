@@ -0,0 +1,313 @@
+/* async_log.c
+** strophe_ruby -- non-blocking logging for contexts
+**
+** The ring is Dmitry Vyukov's bounded MPMC queue: every slot has a sequence
+** number telling producers and consumers whose turn it is, so neither side
+** ever takes a lock. The mutex and condition only put an idle drain to sleep.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "async_log.h"
+
+#define LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define ACQUIRE(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define RELEASE(var, n) __atomic_store_n(&(var), (n), __ATOMIC_RELEASE)
+#define ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+
+typedef struct {
+    size_t seq;
+    async_log_entry_t entry;
+} async_log_slot_t;
+
+struct _async_log_t {
+    xmpp_log_t handler;
+    xmpp_log_level_t level;
+    int refs;
+    int closed;
+    void *userdata;
+
+    int fd;
+    int owns_fd;
+    int started;  /* the file writer thread */
+
+    size_t head;  /* next slot to take */
+    size_t tail;  /* next slot to fill */
+    async_log_slot_t slots[ASYNC_LOG_SLOTS];
+
+    uint64_t queued;
+    uint64_t done;
+    async_log_stats_t stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int sleeping;
+};
+
+static const char * const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/* copy what fits of src, 1 if it didn't all fit */
+static int _copy(char * const dst, const char * const src, const size_t size) {
+    size_t len = strlen(src);
+
+    if (len < size) {
+	memcpy(dst, src, len + 1);
+	return 0;
+    }
+    memcpy(dst, src, size - 1);
+    dst[size - 1] = '\0';
+    return 1;
+}
+
+static void _wake(async_log_t * const log) {
+    pthread_mutex_lock(&log->lock);
+    pthread_cond_broadcast(&log->wakeup);
+    pthread_mutex_unlock(&log->lock);
+}
+
+static void *_writer(void *ptr);
+
+static void _start_writer(async_log_t * const log) {
+    pthread_t thread;
+    int expected = 0;
+
+    if (!__atomic_compare_exchange_n(&log->started, &expected, 1, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	return;
+    async_log_ref(log);
+    if (pthread_create(&thread, NULL, _writer, log) != 0) {
+	/* async_log_close writes out whatever is left */
+	async_log_unref(log);
+	return;
+    }
+    pthread_detach(thread);
+}
+
+/* the xmpp_log_handler: filter, then queue without blocking */
+static void _handle(void * const userdata, const xmpp_log_level_t level,
+		    const char * const area, const char * const msg) {
+    async_log_t *log = (async_log_t *)userdata;
+    async_log_slot_t *slot;
+    size_t pos, seq;
+
+    if (level < log->level || LOAD(log->closed))
+	return;
+
+    pos = LOAD(log->tail);
+    for (;;) {
+	slot = &log->slots[pos & (ASYNC_LOG_SLOTS - 1)];
+	seq = ACQUIRE(slot->seq);
+	if (seq == pos) {
+	    if (__atomic_compare_exchange_n(&log->tail, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if ((long)(seq - pos) < 0) {
+	    ADD(log->stats.dropped, 1);
+	    return;
+	} else {
+	    pos = LOAD(log->tail);
+	}
+    }
+
+    slot->entry.level = level;
+    _copy(slot->entry.area, area ? area : "", ASYNC_LOG_AREA);
+    if (_copy(slot->entry.msg, msg ? msg : "", ASYNC_LOG_MSG))
+	ADD(log->stats.truncated, 1);
+    ADD(log->queued, 1);
+    RELEASE(slot->seq, pos + 1);
+
+    if (log->fd >= 0 && !LOAD(log->started))
+	_start_writer(log);
+    if (LOAD(log->sleeping))
+	_wake(log);
+}
+
+async_log_t *async_log_new(const xmpp_log_level_t level, const int fd, const int owns_fd) {
+    async_log_t *log = calloc(1, sizeof(*log));
+    size_t i;
+
+    if (!log)
+	return NULL;
+    log->handler.handler = _handle;
+    log->handler.userdata = log;
+    log->level = level;
+    log->refs = 1;
+    log->fd = fd;
+    log->owns_fd = owns_fd;
+    for (i = 0; i < ASYNC_LOG_SLOTS; i++)
+	log->slots[i].seq = i;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wakeup, NULL);
+    return log;
+}
+
+const xmpp_log_t *async_log_handler(async_log_t * const log) {
+    return &log->handler;
+}
+
+void async_log_ref(async_log_t * const log) {
+    ADD(log->refs, 1);
+}
+
+void async_log_unref(async_log_t * const log) {
+    if (__atomic_sub_fetch(&log->refs, 1, __ATOMIC_ACQ_REL) > 0)
+	return;
+    if (log->owns_fd && log->fd >= 0)
+	close(log->fd);
+    pthread_cond_destroy(&log->wakeup);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+int async_log_wants(const xmpp_ctx_t * const ctx, const xmpp_log_level_t level) {
+    const xmpp_log_t *handler = ctx->log;
+
+    if (!handler || !handler->handler)
+	return 0;
+    if (handler->handler != _handle)
+	return 1;
+    return level >= ((async_log_t *)handler->userdata)->level;
+}
+
+int async_log_pop(async_log_t * const log, async_log_entry_t * const entry) {
+    async_log_slot_t *slot;
+    size_t pos, seq;
+
+    pos = LOAD(log->head);
+    for (;;) {
+	slot = &log->slots[pos & (ASYNC_LOG_SLOTS - 1)];
+	seq = ACQUIRE(slot->seq);
+	if (seq == pos + 1) {
+	    if (__atomic_compare_exchange_n(&log->head, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	} else if ((long)(seq - (pos + 1)) < 0) {
+	    return 0;
+	} else {
+	    pos = LOAD(log->head);
+	}
+    }
+    *entry = slot->entry;
+    RELEASE(slot->seq, pos + ASYNC_LOG_SLOTS);
+    return 1;
+}
+
+void async_log_done(async_log_t * const log) {
+    ADD(log->stats.written, 1);
+    ADD(log->done, 1);
+}
+
+void async_log_wait(async_log_t * const log, const int timeout_ms) {
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    __atomic_store_n(&log->sleeping, 1, __ATOMIC_SEQ_CST);
+    /* a producer seeing sleeping == 0 may have queued just before */
+    if (LOAD(log->queued) == LOAD(log->done) && !LOAD(log->closed))
+	pthread_cond_timedwait(&log->wakeup, &log->lock, &until);
+    __atomic_store_n(&log->sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&log->lock);
+}
+
+void async_log_wake(async_log_t * const log) {
+    _wake(log);
+}
+
+int async_log_closed(async_log_t * const log) {
+    return LOAD(log->closed);
+}
+
+int async_log_flush(async_log_t * const log, const int timeout_ms) {
+    uint64_t target = LOAD(log->queued);
+    struct timespec pause = { 0, 1000000 };
+    int waited;
+
+    async_log_wake(log);
+    for (waited = 0; (int64_t)(LOAD(log->done) - target) < 0; waited++) {
+	if (waited >= timeout_ms)
+	    return 0;
+	nanosleep(&pause, NULL);
+    }
+    return 1;
+}
+
+void async_log_stats(async_log_t * const log, async_log_stats_t * const stats) {
+    stats->written = LOAD(log->stats.written);
+    stats->dropped = LOAD(log->stats.dropped);
+    stats->truncated = LOAD(log->stats.truncated);
+}
+
+void *async_log_userdata(async_log_t * const log) {
+    return log->userdata;
+}
+
+void async_log_set_userdata(async_log_t * const log, void * const userdata) {
+    log->userdata = userdata;
+}
+
+/* write one message the way libstrophe's default logger does */
+static void _write_entry(async_log_t * const log, const async_log_entry_t * const entry) {
+    char line[ASYNC_LOG_AREA + ASYNC_LOG_MSG + 16];
+    size_t len = 0, off = 0;
+    ssize_t ret;
+
+    len = strlen(entry->area);
+    memcpy(line, entry->area, len);
+    line[len++] = ' ';
+    strcpy(line + len, level_names[entry->level]);
+    len += strlen(level_names[entry->level]);
+    line[len++] = ' ';
+    strcpy(line + len, entry->msg);
+    len += strlen(entry->msg);
+    line[len++] = '\n';
+
+    while (off < len) {
+	ret = write(log->fd, line + off, len - off);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    break;
+	off += ret;
+    }
+    async_log_done(log);
+}
+
+/* the background thread of a file log */
+static void *_writer(void *ptr) {
+    async_log_t *log = (async_log_t *)ptr;
+    async_log_entry_t entry;
+
+    for (;;) {
+	while (async_log_pop(log, &entry))
+	    _write_entry(log, &entry);
+	if (LOAD(log->closed))
+	    break;
+	async_log_wait(log, 100);
+    }
+    async_log_unref(log);
+    return NULL;
+}
+
+void async_log_close(async_log_t * const log) {
+    async_log_entry_t entry;
+
+    __atomic_store_n(&log->closed, 1, __ATOMIC_SEQ_CST);
+    if (log->fd >= 0) {
+	while (async_log_pop(log, &entry))
+	    _write_entry(log, &entry);
+    }
+    _wake(log);
+    async_log_unref(log);
+}
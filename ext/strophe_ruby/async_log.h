@@ -0,0 +1,87 @@
+/* async_log.h
+** strophe_ruby -- non-blocking logging for contexts
+**
+** An xmpp_log_t whose handler drops messages under the context's level
+** before touching them and copies the others into a fixed ring of slots,
+** a bounded lock-free queue safe for several producers and consumers. The
+** event loop never waits on the output: when the ring is full the message
+** is dropped and counted.
+**
+** The ring is drained by a native thread writing to a file descriptor, or
+** by the binding itself (async_log_pop) for a Ruby callback. Messages longer
+** than a slot are truncated and counted.
+**
+** libstrophe formats a message before calling the handler, so the level
+** check only saves the copy there. Callers that would build an expensive
+** message themselves, eg. serializing every received stanza at DEBUG, ask
+** async_log_wants first.
+*/
+
+#ifndef __STROPHE_RUBY_ASYNC_LOG_H__
+#define __STROPHE_RUBY_ASYNC_LOG_H__
+
+#include <stdint.h>
+#include "strophe.h"
+#include "strophe/common.h"
+
+#define ASYNC_LOG_SLOTS 256  /* a power of two */
+#define ASYNC_LOG_AREA 16
+#define ASYNC_LOG_MSG 1024
+
+typedef struct {
+    xmpp_log_level_t level;
+    char area[ASYNC_LOG_AREA];
+    char msg[ASYNC_LOG_MSG];
+} async_log_entry_t;
+
+typedef struct _async_log_t async_log_t;
+
+typedef struct {
+    uint64_t written;    /* handed to the file or the callback */
+    uint64_t dropped;    /* the ring was full */
+    uint64_t truncated;  /* longer than a slot */
+} async_log_stats_t;
+
+/* a log writing to fd from a background thread, closing it at the end if
+   owns_fd. With fd < 0 the binding drains the log itself. NULL if out of memory */
+async_log_t *async_log_new(const xmpp_log_level_t level, const int fd, const int owns_fd);
+
+/* the handler to give xmpp_ctx_new, valid until async_log_close */
+const xmpp_log_t *async_log_handler(async_log_t * const log);
+
+/* stop taking messages. A file log writes out what's left first, the log
+   is freed once its drain let go of it too */
+void async_log_close(async_log_t * const log);
+
+/* references for whoever drains the log, see async_log_pop */
+void async_log_ref(async_log_t * const log);
+void async_log_unref(async_log_t * const log);
+
+/* would a message at level be kept by the context's logger */
+int async_log_wants(const xmpp_ctx_t * const ctx, const xmpp_log_level_t level);
+
+/* take the oldest message, 0 if there is none */
+int async_log_pop(async_log_t * const log, async_log_entry_t * const entry);
+
+/* count the message taken by async_log_pop as handed out */
+void async_log_done(async_log_t * const log);
+
+/* wait up to timeout_ms for a message or for the log to close. No Ruby, may
+   run without the GVL. async_log_wake cuts the wait short */
+void async_log_wait(async_log_t * const log, const int timeout_ms);
+void async_log_wake(async_log_t * const log);
+
+/* nonzero once async_log_close was called */
+int async_log_closed(async_log_t * const log);
+
+/* wait up to timeout_ms until everything queued so far was handed out,
+   0 if it timed out. No Ruby, may run without the GVL */
+int async_log_flush(async_log_t * const log, const int timeout_ms);
+
+void async_log_stats(async_log_t * const log, async_log_stats_t * const stats);
+
+/* the binding's Ruby callback, kept as a VALUE */
+void *async_log_userdata(async_log_t * const log);
+void async_log_set_userdata(async_log_t * const log, void * const userdata);
+
+#endif /* __STROPHE_RUBY_ASYNC_LOG_H__ */
@@ -0,0 +1,135 @@
+/* capture.c
+** strophe_ruby -- recording and replaying a connection's traffic
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "stats.h"
+
+/* a write buffer covering a few socket reads */
+#define CAPTURE_BUFFER (64 * 1024)
+
+/* no record is larger than a send queue item, keep corrupt lengths from allocating the world */
+#define CAPTURE_MAX_RECORD (256 * 1024 * 1024)
+
+static int _put_varint(FILE * const file, uint64_t value) {
+    unsigned char buf[10];
+    int n = 0;
+
+    do {
+	buf[n] = value & 0x7f;
+	value >>= 7;
+	if (value)
+	    buf[n] |= 0x80;
+	n++;
+    } while (value);
+    return fwrite(buf, 1, n, file) == (size_t)n;
+}
+
+static int _get_varint(FILE * const file, uint64_t * const value) {
+    int c, shift;
+
+    *value = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+	if ((c = getc(file)) == EOF)
+	    return 0;
+	*value |= (uint64_t)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return 1;
+    }
+    return 0;
+}
+
+capture_t *capture_open(const char * const path) {
+    capture_t *capture = calloc(1, sizeof(*capture));
+    long size;
+
+    if (!capture)
+	return NULL;
+    if (!(capture->file = fopen(path, "ab"))) {
+	free(capture);
+	return NULL;
+    }
+    setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFFER);
+    fseek(capture->file, 0, SEEK_END);
+    size = ftell(capture->file);
+    if (size == 0 && fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capture->file) != CAPTURE_MAGIC_LEN)
+	capture->failed = 1;
+    capture->last = stats_now();
+    capture_write(capture, CAPTURE_RESET, NULL, 0);
+    return capture;
+}
+
+int capture_write(capture_t * const capture, const capture_kind_t kind,
+		  const char * const data, const size_t len) {
+    uint64_t now;
+
+    if (capture->failed)
+	return 0;
+    now = stats_now();
+    if (putc(kind, capture->file) == EOF || !_put_varint(capture->file, now - capture->last) ||
+	!_put_varint(capture->file, len) || (len && fwrite(data, 1, len, capture->file) != len)) {
+	capture->failed = 1;
+	return 0;
+    }
+    capture->last = now;
+    capture->records++;
+    capture->bytes += len;
+    return 1;
+}
+
+int capture_close(capture_t * const capture) {
+    int ok = !capture->failed;
+
+    if (fclose(capture->file) != 0)
+	ok = 0;
+    free(capture);
+    return ok;
+}
+
+int capture_reader_open(capture_reader_t * const reader, const char * const path) {
+    char magic[CAPTURE_MAGIC_LEN];
+
+    memset(reader, 0, sizeof(*reader));
+    if (!(reader->file = fopen(path, "rb")))
+	return -1;
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, reader->file) != CAPTURE_MAGIC_LEN ||
+	memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+	fclose(reader->file);
+	reader->file = NULL;
+	return -2;
+    }
+    return 0;
+}
+
+int capture_reader_next(capture_reader_t * const reader, capture_record_t * const record) {
+    uint64_t len;
+    char *buf;
+    int kind;
+
+    if ((kind = getc(reader->file)) == EOF)
+	return 0;
+    if (kind > CAPTURE_RESET || !_get_varint(reader->file, &record->delta) ||
+	!_get_varint(reader->file, &len) || len > CAPTURE_MAX_RECORD)
+	return -1;
+    if (len > reader->size) {
+	if (!(buf = realloc(reader->buf, len)))
+	    return -1;
+	reader->buf = buf;
+	reader->size = len;
+    }
+    if (len && fread(reader->buf, 1, len, reader->file) != len)
+	return -1;
+    record->kind = kind;
+    record->len = len;
+    record->data = reader->buf;
+    return 1;
+}
+
+void capture_reader_close(capture_reader_t * const reader) {
+    if (reader->file)
+	fclose(reader->file);
+    free(reader->buf);
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,76 @@
+/* capture.h
+** strophe_ruby -- recording and replaying a connection's traffic
+**
+** A capture is the plaintext of a stream as the connection saw it: what came
+** out of sock_read/tls_read on its way to the parser, and the stanzas and raw
+** data sent through the binding (libstrophe's own stream headers and
+** authentication exchange never pass through it). The file
+** starts with the CAPTURE_MAGIC bytes, then records of
+**
+**   kind    one byte, a capture_kind_t
+**   delta   LEB128, nanoseconds since the previous record (monotonic clock)
+**   length  LEB128
+**   data    length bytes
+**
+** Files are only ever appended to. Every capture_open starts with a
+** CAPTURE_RESET record, as does every parser reset (a new stream after
+** STARTTLS or SASL), so replay knows where a stream document begins.
+**
+** No locking: a capture is written by the thread running the event loop.
+*/
+
+#ifndef __STROPHE_RUBY_CAPTURE_H__
+#define __STROPHE_RUBY_CAPTURE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "SRCAP\0\1\n"
+#define CAPTURE_MAGIC_LEN 8
+
+typedef enum {
+    CAPTURE_IN,     /* read from the socket */
+    CAPTURE_OUT,    /* sent through the binding */
+    CAPTURE_RESET   /* a new stream starts, no data */
+} capture_kind_t;
+
+typedef struct {
+    FILE *file;
+    uint64_t last;     /* clock of the previous record */
+    uint64_t records;
+    uint64_t bytes;    /* data bytes written, framing left out */
+    int failed;        /* a write failed, the capture stopped there */
+} capture_t;
+
+typedef struct {
+    FILE *file;
+    char *buf;
+    size_t size;
+} capture_reader_t;
+
+typedef struct {
+    capture_kind_t kind;
+    uint64_t delta;
+    size_t len;
+    const char *data;  /* valid until the next capture_reader_next */
+} capture_record_t;
+
+/* start appending to path, NULL with errno set on failure */
+capture_t *capture_open(const char * const path);
+
+/* add a record, 0 once a write failed */
+int capture_write(capture_t * const capture, const capture_kind_t kind,
+		  const char * const data, const size_t len);
+
+/* flush and free, 0 if a write failed along the way */
+int capture_close(capture_t * const capture);
+
+/* 0 when open, -1 with errno set, -2 if path is not a capture */
+int capture_reader_open(capture_reader_t * const reader, const char * const path);
+
+/* the next record: 1, 0 at the end of the file, -1 if the file is corrupt or cut short */
+int capture_reader_next(capture_reader_t * const reader, capture_record_t * const record);
+
+void capture_reader_close(capture_reader_t * const reader);
+
+#endif /* __STROPHE_RUBY_CAPTURE_H__ */
@@ -0,0 +1,37 @@
+/* event.c
+** strophe_ruby -- event loop
+**
+** libstrophe's xmpp_run_once does the socket work, reading into the
+** connections' parsers (xml_parser.c) and resetting them on stream restarts.
+** What the binding adds is a safe point between passes, where the handlers
+** removed while blocks were running are finally taken out.
+*/
+
+#include "strophe_ruby.h"
+
+#define DEFAULT_TIMEOUT 1
+
+/* one pass of the loop: flush writes, wait up to timeout ms for events, handle them */
+void event_run_once(t_ctx_t *tctx, const unsigned long timeout) {
+    t_conn_t *tc;
+
+    /* handlers removed from their blocks last pass, libstrophe isn't walking its lists now */
+    for (tc = tctx->conns; tc; tc = tc->next)
+	if (tc->prune && !tc->dispatching)
+	    conn_handlers_prune(tc);
+
+    xmpp_run_once(tctx->ctx, timeout);
+}
+
+/* run until xmpp_stop is called */
+void event_run(t_ctx_t *tctx) {
+    xmpp_ctx_t *ctx = tctx->ctx;
+
+    if (ctx->loop_status != XMPP_LOOP_NOTSTARTED) return;
+
+    ctx->loop_status = XMPP_LOOP_RUNNING;
+    while (ctx->loop_status == XMPP_LOOP_RUNNING)
+	event_run_once(tctx, DEFAULT_TIMEOUT);
+
+    xmpp_debug(ctx, "event", "Event loop completed.");
+}
@@ -5,4 +5,17 @@ dir_config("strophe")
 have_library("strophe")
 have_library("ssl")
 have_library("resolv")
+have_library("pthread")
+# strophe/common.h and xml_parser.c follow the libstrophe whose connections parse through
+# parser_new/parser_feed (strophe/parser.h), older ones kept an expat parser in the connection
+unless have_func("conn_parser_reset")
+  abort "libstrophe without parser_t (no conn_parser_reset), strophe/common.h doesn't match it"
+end
+have_func("rb_hash_new_capa", "ruby.h")
+have_func("rb_gc_adjust_memory_usage", "ruby.h")
+# USDT probes for tracing, see probes.h: gem install strophe_ruby -- --enable-usdt
+if enable_config("usdt", false)
+  abort "--enable-usdt needs sys/sdt.h (systemtap-sdt-dev)" unless have_header("sys/sdt.h")
+  $defs << "-DSTROPHE_RUBY_USDT"
+end
 create_makefile("strophe_ruby")
@@ -0,0 +1,229 @@
+/* mem.c
+** strophe_ruby -- native memory accounting for contexts
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+/* in front of every block, keeps the payload aligned like malloc's */
+typedef union {
+    struct {
+	size_t size;
+	mem_account_t *account;  /* expat blocks only */
+	mem_meter_t *meter;
+	unsigned char category;
+    } h;
+    long double align;
+} mem_header_t;
+
+static const char * const category_names[MEM_CATEGORY_COUNT] = {
+    "other", "stanza", "send_queue", "parser", "handler", "hash"
+};
+
+#if defined(__GNUC__)
+#define MEM_TLS __thread
+#else
+#define MEM_TLS
+#endif
+
+static MEM_TLS mem_scope_t current;
+
+#define ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define SUB(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_RELAXED)
+
+static void _peak(size_t * const peak, const size_t now) {
+    if (now > __atomic_load_n(peak, __ATOMIC_RELAXED))
+	__atomic_store_n(peak, now, __ATOMIC_RELAXED);
+}
+
+static void _charge(mem_account_t * const account, const mem_header_t * const header) {
+    ADD(account->allocations, 1);
+    _peak(&account->peak, ADD(account->bytes, header->h.size));
+    _peak(&account->category_peak[header->h.category],
+	  ADD(account->category[header->h.category], header->h.size));
+    if (header->h.meter)
+	ADD(header->h.meter->bytes, header->h.size);
+    ADD(account->gc_pending, (long)header->h.size);
+}
+
+static void _discharge(mem_account_t * const account, const mem_header_t * const header) {
+    SUB(account->bytes, header->h.size);
+    SUB(account->category[header->h.category], header->h.size);
+    if (header->h.meter)
+	SUB(header->h.meter->bytes, header->h.size);
+    SUB(account->gc_pending, (long)header->h.size);
+}
+
+/* category for a block allocated now on account */
+static unsigned char _category(const mem_account_t * const account) {
+    return current.account == account ? current.category : MEM_OTHER;
+}
+
+static void *_alloc(const size_t size, void * const userdata) {
+    mem_account_t *account = (mem_account_t *)userdata;
+    mem_header_t *header = malloc(sizeof(mem_header_t) + size);
+
+    if (!header)
+	return NULL;
+    header->h.size = size;
+    header->h.account = NULL;
+    header->h.meter = current.account == account ? current.meter : NULL;
+    header->h.category = _category(account);
+    _charge(account, header);
+    return header + 1;
+}
+
+static void _free(void *p, void * const userdata) {
+    mem_header_t *header;
+
+    if (!p)
+	return;
+    header = (mem_header_t *)p - 1;
+    _discharge((mem_account_t *)userdata, header);
+    free(header);
+}
+
+static void *_realloc(void *p, const size_t size, void * const userdata) {
+    mem_account_t *account = (mem_account_t *)userdata;
+    mem_header_t *header, old;
+    unsigned char category;
+
+    if (!p)
+	return _alloc(size, userdata);
+    header = (mem_header_t *)p - 1;
+    old = *header;
+    if (!(header = realloc(header, sizeof(mem_header_t) + size)))
+	return NULL;
+
+    /* a buffer handed on, eg. parser text becoming a text node, moves to the current scope */
+    category = _category(account);
+    header->h.size = size;
+    if (category != MEM_OTHER)
+	header->h.category = category;
+    _discharge(account, &old);
+    _charge(account, header);
+    return header + 1;
+}
+
+void mem_account_init(mem_account_t * const account, void * const owner) {
+    memset(account, 0, sizeof(*account));
+    account->hooks.alloc = _alloc;
+    account->hooks.free = _free;
+    account->hooks.realloc = _realloc;
+    account->hooks.userdata = account;
+    account->owner = owner;
+}
+
+mem_account_t *mem_account_of(const xmpp_ctx_t * const ctx) {
+    if (!ctx || ctx->mem->alloc != _alloc)
+	return NULL;
+    return (mem_account_t *)ctx->mem->userdata;
+}
+
+mem_scope_t mem_scope_enter(mem_account_t * const account, const mem_category_t category) {
+    mem_scope_t previous = current;
+
+    if (account)
+	current.account = account;
+    current.category = category;
+    current.meter = NULL;
+    return previous;
+}
+
+void mem_scope_meter(mem_meter_t * const meter) {
+    current.meter = meter;
+}
+
+void mem_scope_leave(const mem_scope_t previous) {
+    current = previous;
+}
+
+/* expat's suite has no userdata, each block remembers the account it was charged to */
+static void *_expat_malloc(size_t size) {
+    mem_header_t *header = malloc(sizeof(mem_header_t) + size);
+
+    if (!header)
+	return NULL;
+    header->h.size = size;
+    header->h.account = current.account;
+    header->h.meter = NULL;
+    header->h.category = MEM_PARSER;
+    if (header->h.account)
+	_charge(header->h.account, header);
+    return header + 1;
+}
+
+static void _expat_free(void *p) {
+    mem_header_t *header;
+
+    if (!p)
+	return;
+    header = (mem_header_t *)p - 1;
+    if (header->h.account)
+	_discharge(header->h.account, header);
+    free(header);
+}
+
+static void *_expat_realloc(void *p, size_t size) {
+    mem_header_t *header, old;
+
+    if (!p)
+	return _expat_malloc(size);
+    header = (mem_header_t *)p - 1;
+    old = *header;
+    if (!(header = realloc(header, sizeof(mem_header_t) + size)))
+	return NULL;
+    header->h.size = size;
+    if (old.h.account) {
+	_discharge(old.h.account, &old);
+	_charge(old.h.account, header);
+    }
+    return header + 1;
+}
+
+static const XML_Memory_Handling_Suite expat_suite = {
+    _expat_malloc, _expat_realloc, _expat_free
+};
+
+XML_Parser mem_parser_create(void) {
+    return XML_ParserCreate_MM(NULL, &expat_suite, NULL);
+}
+
+long mem_gc_take(mem_account_t * const account) {
+    if (!__atomic_load_n(&account->gc_pending, __ATOMIC_RELAXED))
+	return 0;
+    return __atomic_exchange_n(&account->gc_pending, 0, __ATOMIC_RELAXED);
+}
+
+/* nodes of the tree, or only those releasing it frees: like xmpp_stanza_release, a node
+   goes with its last reference and takes its children's references with it */
+static size_t _stanza_nodes(const xmpp_stanza_t * const stanza, const int freed) {
+    const xmpp_stanza_t *child;
+    size_t nodes = 1;
+
+    if (freed && stanza->ref != 1)
+	return 0;
+    for (child = stanza->children; child; child = child->next)
+	nodes += _stanza_nodes(child, freed);
+    return nodes;
+}
+
+void mem_stanzas_built(xmpp_stanza_t * const stanza) {
+    mem_account_t *account = mem_account_of(stanza->ctx);
+
+    if (account)
+	_peak(&account->stanzas_peak, ADD(account->stanzas, _stanza_nodes(stanza, 0)));
+}
+
+void mem_stanza_release(xmpp_stanza_t * const stanza) {
+    mem_account_t *account = mem_account_of(stanza->ctx);
+
+    if (account)
+	SUB(account->stanzas, _stanza_nodes(stanza, 1));
+    xmpp_stanza_release(stanza);
+}
+
+const char *mem_category_name(const mem_category_t category) {
+    return category_names[category];
+}
@@ -0,0 +1,93 @@
+/* mem.h
+** strophe_ruby -- native memory accounting for contexts
+**
+** Every context the binding creates allocates through an xmpp_mem_t that puts
+** a small header in front of each block, holding its size and the category it
+** is charged to. The category is a thread-local scope which the binding sets
+** around the calls that allocate: building stanza trees, queueing data to
+** send, parsing, registering handlers, filling attribute tables. Blocks
+** allocated outside of any scope count as "other". A scope may also carry a
+** meter, which follows its blocks until they are freed, eg. the bytes of one
+** connection's send queue. Expat parsers are created with a memory suite
+** charging the account of the scope current when they allocate.
+**
+** Counters are updated with relaxed atomics since parsing may run without the
+** GVL. Peaks are best effort under contention.
+*/
+
+#ifndef __STROPHE_RUBY_MEM_H__
+#define __STROPHE_RUBY_MEM_H__
+
+#include "strophe.h"
+#include "strophe/common.h"
+#include "strophe/expat.h"
+
+typedef enum {
+    MEM_OTHER,
+    MEM_STANZA,      /* stanza trees and their text */
+    MEM_SEND_QUEUE,  /* serialized data waiting to be written */
+    MEM_PARSER,      /* expat and the binding's parse buffers */
+    MEM_HANDLER,     /* handler lists */
+    MEM_HASH,        /* attribute tables and the id handler table's entries */
+    MEM_CATEGORY_COUNT
+} mem_category_t;
+
+typedef struct {
+    xmpp_mem_t hooks;
+    void *owner;  /* whoever embeds the account */
+
+    size_t bytes;
+    size_t peak;
+    size_t category[MEM_CATEGORY_COUNT];
+    size_t category_peak[MEM_CATEGORY_COUNT];
+
+    /* stanza nodes built by the binding and not freed yet, see mem_stanzas_built */
+    size_t stanzas;
+    size_t stanzas_peak;
+
+    size_t allocations;  /* calls to malloc and realloc so far */
+
+    long gc_pending;  /* change in bytes not taken by mem_gc_take yet */
+} mem_account_t;
+
+/* bytes still allocated of the blocks charged to it */
+typedef struct {
+    size_t bytes;
+} mem_meter_t;
+
+typedef struct {
+    mem_account_t *account;
+    mem_category_t category;
+    mem_meter_t *meter;
+} mem_scope_t;
+
+void mem_account_init(mem_account_t * const account, void * const owner);
+
+/* the account behind a context, NULL if it doesn't allocate through one */
+mem_account_t *mem_account_of(const xmpp_ctx_t * const ctx);
+
+/* charge this thread's allocations to account and category until the matching
+   mem_scope_leave. A NULL account keeps the current one, the meter is cleared */
+mem_scope_t mem_scope_enter(mem_account_t * const account, const mem_category_t category);
+void mem_scope_leave(const mem_scope_t previous);
+
+/* also charge the blocks allocated in the current scope to meter, which must outlive them */
+void mem_scope_meter(mem_meter_t * const meter);
+
+/* an expat parser allocating through the current scope's account */
+XML_Parser mem_parser_create(void);
+
+/* the change in bytes since the last call, for rb_gc_adjust_memory_usage */
+long mem_gc_take(mem_account_t * const account);
+
+/* the nodes of a tree the binding just built or copied count as live until freed by
+   mem_stanza_release, which the binding uses in place of xmpp_stanza_release. Trees libstrophe
+   builds and frees itself aren't counted, the one exception being a received stream error it
+   keeps a reference on: libstrophe frees it and it stays counted */
+void mem_stanzas_built(xmpp_stanza_t * const stanza);
+void mem_stanza_release(xmpp_stanza_t * const stanza);
+
+/* "other", "stanza", "send_queue", "parser", "handler" or "hash" */
+const char *mem_category_name(const mem_category_t category);
+
+#endif /* __STROPHE_RUBY_MEM_H__ */
@@ -0,0 +1,53 @@
+/* probes.h
+** strophe_ruby -- USDT static tracepoints
+**
+** Built with `gem install strophe_ruby -- --enable-usdt` (needs sys/sdt.h,
+** eg. from systemtap-sdt-dev) these are systemtap-style probes under the
+** strophe_ruby provider: a nop in the code and a note in the ELF file until
+** a tracer attaches, see script/trace for bpftrace scripts. Without the flag
+** they compile to nothing. Arguments are only values already at hand, the
+** tracer takes its own timestamps.
+**
+**   read(conn, bytes)                      bytes came off the socket
+**   parse__start(conn, bytes)              a chunk goes into expat
+**   parse__done(conn, bytes, ok)
+**   dispatch__start(conn, name, read_at)   libstrophe fires the handlers of a
+**   dispatch__done(conn, name)             stanza, read_at as in stats.h
+**   handler__start(conn, blocks)           the Ruby blocks for one stanza
+**   handler__done(conn, blocks)
+**   send(conn, name, queued_bytes)         a stanza ("" for raw data) was queued
+**
+** conn is the xmpp_conn_t pointer, name a C string.
+*/
+
+#ifndef __STROPHE_RUBY_PROBES_H__
+#define __STROPHE_RUBY_PROBES_H__
+
+#ifdef STROPHE_RUBY_USDT
+#include <sys/sdt.h>
+
+#define PROBE_READ(conn, bytes) DTRACE_PROBE2(strophe_ruby, read, conn, bytes)
+#define PROBE_PARSE_START(conn, bytes) DTRACE_PROBE2(strophe_ruby, parse__start, conn, bytes)
+#define PROBE_PARSE_DONE(conn, bytes, ok) DTRACE_PROBE3(strophe_ruby, parse__done, conn, bytes, ok)
+#define PROBE_DISPATCH_START(conn, name, read_at) \
+    DTRACE_PROBE3(strophe_ruby, dispatch__start, conn, name, read_at)
+#define PROBE_DISPATCH_DONE(conn, name) DTRACE_PROBE2(strophe_ruby, dispatch__done, conn, name)
+#define PROBE_HANDLER_START(conn, blocks) DTRACE_PROBE2(strophe_ruby, handler__start, conn, blocks)
+#define PROBE_HANDLER_DONE(conn, blocks) DTRACE_PROBE2(strophe_ruby, handler__done, conn, blocks)
+#define PROBE_SEND(conn, name, queued) DTRACE_PROBE3(strophe_ruby, send, conn, name, queued)
+
+#else
+
+#define PROBE_READ(conn, bytes) do {} while (0)
+#define PROBE_PARSE_START(conn, bytes) do {} while (0)
+#define PROBE_PARSE_DONE(conn, bytes, ok) do {} while (0)
+#define PROBE_DISPATCH_START(conn, name, read_at) do {} while (0)
+#define PROBE_DISPATCH_DONE(conn, name) do {} while (0)
+#define PROBE_HANDLER_START(conn, blocks) do {} while (0)
+#define PROBE_HANDLER_DONE(conn, blocks) do {} while (0)
+/* queued is computed for the stats anyway, use it so it isn't reported unused */
+#define PROBE_SEND(conn, name, queued) do { (void)(queued); } while (0)
+
+#endif
+
+#endif /* __STROPHE_RUBY_PROBES_H__ */
@@ -0,0 +1,168 @@
+/* stats.c
+** strophe_ruby -- per connection counters and latency histograms
+*/
+
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+#define ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+#ifdef _WIN32
+/* from libstrophe's util.h, milliseconds */
+uint64_t time_stamp(void);
+
+uint64_t stats_now(void) {
+    return time_stamp() * 1000000;
+}
+#else
+uint64_t stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+void stats_add(uint64_t * const counter, const uint64_t n) {
+    ADD(*counter, n);
+}
+
+/* best effort under contention, same as the memory peaks */
+void stats_peak(uint64_t * const peak, const uint64_t now) {
+    if (now > LOAD(*peak))
+	__atomic_store_n(peak, now, __ATOMIC_RELAXED);
+}
+
+static int _kind_matches(const stats_kind_t * const kind, const char * const name,
+			 const char * const type) {
+    return strncmp(kind->name, name, STATS_KIND_LEN - 1) == 0 &&
+	strncmp(kind->type, type, STATS_KIND_LEN - 1) == 0;
+}
+
+/* the slot counting name/type. New kinds are only added by the thread holding the GVL */
+static stats_kind_t *_kind(stats_conn_t * const stats, const char * const name,
+			   const char * const type) {
+    stats_kind_t *kind;
+    int i;
+
+    for (i = 0; i < stats->nkinds; i++) {
+	if (_kind_matches(&stats->kinds[i], name, type))
+	    return &stats->kinds[i];
+    }
+    if (stats->nkinds == STATS_KINDS_MAX)
+	return &stats->kinds[STATS_KINDS_MAX - 1];
+
+    kind = &stats->kinds[stats->nkinds];
+    if (stats->nkinds == STATS_KINDS_MAX - 1) {
+	strcpy(kind->name, "other");
+	kind->type[0] = '\0';
+    } else {
+	strncpy(kind->name, name, STATS_KIND_LEN - 1);
+	strncpy(kind->type, type, STATS_KIND_LEN - 1);
+    }
+    __atomic_store_n(&stats->nkinds, stats->nkinds + 1, __ATOMIC_RELEASE);
+    return kind;
+}
+
+void stats_stanza(stats_conn_t * const stats, const char * const name,
+		  const char * const type, const int out) {
+    stats_kind_t *kind = _kind(stats, name ? name : "", type ? type : "");
+
+    if (out) {
+	ADD(stats->stanzas_out, 1);
+	ADD(kind->out, 1);
+    } else {
+	ADD(stats->stanzas_in, 1);
+	ADD(kind->in, 1);
+    }
+}
+
+static int _bucket(const uint64_t ns) {
+    int msb, shift, bucket;
+
+    if (ns < STATS_HIST_SUB)
+	return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    shift = msb - STATS_HIST_SUB_BITS;
+    bucket = (shift + 1) * STATS_HIST_SUB + (int)((ns >> shift) & (STATS_HIST_SUB - 1));
+    return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+/* the largest value counted in bucket */
+static uint64_t _bucket_max(const int bucket) {
+    int shift = bucket / STATS_HIST_SUB - 1;
+    uint64_t sub = bucket % STATS_HIST_SUB;
+
+    if (shift < 0)
+	return bucket;
+    return ((STATS_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+void stats_hist_record(stats_hist_t * const hist, const uint64_t ns) {
+    uint64_t min = LOAD(hist->min);
+
+    if (ADD(hist->count, 1) == 1 || ns < min)
+	__atomic_store_n(&hist->min, ns, __ATOMIC_RELAXED);
+    stats_peak(&hist->max, ns);
+    ADD(hist->sum, ns);
+    ADD(hist->buckets[_bucket(ns)], 1);
+}
+
+uint64_t stats_hist_percentile(const stats_hist_t * const hist, const double q) {
+    uint64_t count = LOAD(hist->count), seen = 0, rank;
+    uint64_t max = LOAD(hist->max), value;
+    int i;
+
+    if (count == 0)
+	return 0;
+    rank = (uint64_t)(q * count + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+	seen += LOAD(hist->buckets[i]);
+	if (seen >= rank) {
+	    value = _bucket_max(i);
+	    return value < max ? value : max;
+	}
+    }
+    return max;
+}
+
+static void _hist_merge(stats_hist_t * const into, const stats_hist_t * const from) {
+    uint64_t count = LOAD(from->count);
+    int i;
+
+    if (count == 0)
+	return;
+    if (into->count == 0 || LOAD(from->min) < into->min)
+	into->min = LOAD(from->min);
+    if (LOAD(from->max) > into->max)
+	into->max = LOAD(from->max);
+    into->count += count;
+    into->sum += LOAD(from->sum);
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+	into->buckets[i] += LOAD(from->buckets[i]);
+}
+
+void stats_merge(stats_conn_t * const into, const stats_conn_t * const from) {
+    stats_kind_t *kind;
+    int i, nkinds = __atomic_load_n(&from->nkinds, __ATOMIC_ACQUIRE);
+
+    into->bytes_read += LOAD(from->bytes_read);
+    into->bytes_written += LOAD(from->bytes_written);
+    into->stanzas_in += LOAD(from->stanzas_in);
+    into->stanzas_out += LOAD(from->stanzas_out);
+    into->connects += LOAD(from->connects);
+    if (LOAD(from->send_queue_peak_bytes) > into->send_queue_peak_bytes)
+	into->send_queue_peak_bytes = LOAD(from->send_queue_peak_bytes);
+
+    for (i = 0; i < nkinds; i++) {
+	kind = _kind(into, from->kinds[i].name, from->kinds[i].type);
+	kind->in += LOAD(from->kinds[i].in);
+	kind->out += LOAD(from->kinds[i].out);
+    }
+    _hist_merge(&into->handler_time, &from->handler_time);
+    _hist_merge(&into->dispatch_latency, &from->dispatch_latency);
+}
@@ -0,0 +1,77 @@
+/* stats.h
+** strophe_ruby -- per connection counters and latency histograms
+**
+** Every connection carries a stats_conn_t: bytes read and written, stanzas
+** in and out by element name and type, the send queue high-water mark and
+** how often it connected. Counters are bumped with relaxed atomics, reading
+** them while a connection is busy gives a close enough snapshot.
+**
+** Histograms are log-linear like HdrHistogram: each power of two range of
+** nanoseconds is split in STATS_HIST_SUB linear buckets, so any value is
+** known within 1/STATS_HIST_SUB of itself for a fixed few KB.
+*/
+
+#ifndef __STROPHE_RUBY_STATS_H__
+#define __STROPHE_RUBY_STATS_H__
+
+#include <stdint.h>
+
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAGNITUDES 40  /* up to 2^40ns, about 18 minutes */
+#define STATS_HIST_BUCKETS (STATS_HIST_MAGNITUDES * STATS_HIST_SUB)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+} stats_hist_t;
+
+/* distinct name/type pairs counted per connection, the last slot gathers the rest */
+#define STATS_KINDS_MAX 32
+#define STATS_KIND_LEN 24
+
+typedef struct {
+    char name[STATS_KIND_LEN];
+    char type[STATS_KIND_LEN];  /* "" when the element has no type */
+    uint64_t in;
+    uint64_t out;
+} stats_kind_t;
+
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t stanzas_in;
+    uint64_t stanzas_out;
+    uint64_t connects;
+    uint64_t send_queue_peak_bytes;
+
+    int nkinds;
+    stats_kind_t kinds[STATS_KINDS_MAX];
+
+    uint64_t read_at;              /* stats_now() when the chunk being parsed was read */
+    stats_hist_t handler_time;     /* running the handlers for one stanza */
+    stats_hist_t dispatch_latency; /* from reading the chunk to running its handlers */
+} stats_conn_t;
+
+/* monotonic nanoseconds */
+uint64_t stats_now(void);
+
+void stats_add(uint64_t * const counter, const uint64_t n);
+void stats_peak(uint64_t * const peak, const uint64_t now);
+
+/* count a toplevel element received (out = 0) or sent (out = 1), type may be NULL */
+void stats_stanza(stats_conn_t * const stats, const char * const name,
+		  const char * const type, const int out);
+
+void stats_hist_record(stats_hist_t * const hist, const uint64_t ns);
+
+/* the value under which a fraction q of the recorded values are, 0 when empty */
+uint64_t stats_hist_percentile(const stats_hist_t * const hist, const double q);
+
+/* add up the counters of several connections, eg. for Context#stats */
+void stats_merge(stats_conn_t * const into, const stats_conn_t * const from);
+
+#endif /* __STROPHE_RUBY_STATS_H__ */
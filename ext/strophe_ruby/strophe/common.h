@@ -31,8 +31,7 @@
 #include "tls.h"
 #include "hash.h"
 #include "util.h"
-
-#include "expat.h"
+#include "parser.h"
 
 /** run-time context **/
 
@@ -190,9 +189,7 @@ struct _xmpp_conn_t {
 
     /* xml parser */
     int reset_parser;
-    XML_Parser parser;
-    int depth;
-    xmpp_stanza_t *stanza;
+    parser_t *parser;
 
     /* timeouts */
     unsigned int connect_timeout;
@@ -250,15 +247,8 @@ struct _xmpp_stanza_t {
 int xmpp_stanza_set_attributes(xmpp_stanza_t * const  stanza,
 			       const char * const * const attr);
 
-/* parser functions */
-void parser_handle_start(void *userdata,
-			 const XML_Char *name,
-			 const XML_Char **attr);
-void parser_handle_character(void *userdata, const XML_Char *s, int len);
-void parser_handle_end(void *userdata, const XML_Char *name);
-void parser_prepare_reset(xmpp_conn_t * const conn, 
-			  xmpp_open_handler handler);
-int parser_reset(xmpp_conn_t * const conn);
+void conn_prepare_reset(xmpp_conn_t * const conn, xmpp_open_handler handler);
+void conn_parser_reset(xmpp_conn_t * const conn);
 
 /* handler management */
 void handler_fire_stanza(xmpp_conn_t * const conn,
@@ -1,6 +1,18 @@
+#include <fcntl.h>
+#include <unistd.h>
 #include <ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
 #include "strophe.h"
 #include "strophe/common.h"
+#include "strophe_ruby.h"
+#include "probes.h"
+#include "xml_escape.h"
+
+#ifndef HAVE_RB_HASH_NEW_CAPA
+#define rb_hash_new_capa(capa) rb_hash_new()
+#endif
 
 VALUE mStropheRuby;
 VALUE mErrorTypes;
@@ -10,13 +22,251 @@ VALUE cConnection;
 VALUE cContext;
 VALUE cStreamError;
 VALUE cEventLoop;
-VALUE client_conn_handler;
 VALUE cStanza;
+VALUE mXML;
+VALUE cRawStanza;
+VALUE cHandler;
+static ID id_call;
+
+/* STR2CSTR went away with ruby 1.9, TypedData needs at least that */
+#ifndef STR2CSTR
+#define STR2CSTR(str) StringValueCStr(str)
+#endif
+
+/* the binding's side of a libstrophe context, NULL for one we didn't create */
+static t_ctx_t *_ctx_of(const xmpp_ctx_t *ctx) {
+    mem_account_t *account = mem_account_of(ctx);
+    return account ? (t_ctx_t *)account->owner : NULL;
+}
+
+/* where libstrophe's parser_new finds the parsers of a context, see xml_parser.h */
+xml_parser_pool_t *ctx_parser_pool(const xmpp_ctx_t * const ctx) {
+    t_ctx_t *tctx = _ctx_of(ctx);
+    return tctx ? &tctx->parsers : NULL;
+}
+
+/* charge what libstrophe allocates from ctx to category until mem_scope_leave */
+static mem_scope_t _mem_scope(const xmpp_ctx_t *ctx, mem_category_t category) {
+    return mem_scope_enter(mem_account_of(ctx), category);
+}
+
+/* tell the GC about native memory allocated or freed since last time. Only with the GVL */
+static void _ctx_gc_sync(t_ctx_t *tctx) {
+    long delta;
+
+    if (!tctx || !(delta = mem_gc_take(&tctx->mem)))
+	return;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    rb_gc_adjust_memory_usage(delta);
+#endif
+}
+
+/* a context logging to log, which it takes over. No logging at all without one */
+static t_ctx_t *_ctx_new(async_log_t * const log) {
+    t_ctx_t *tctx = ALLOC(t_ctx_t);
+
+    memset(tctx, 0, sizeof(*tctx));
+    mem_account_init(&tctx->mem, tctx);
+    tctx->refs = 1;
+    tctx->log = log;
+    if (!(tctx->ctx = xmpp_ctx_new(&tctx->mem.hooks, log ? async_log_handler(log) : NULL))) {
+	if (log)
+	    async_log_close(log);
+	xfree(tctx);
+	rb_raise(rb_eNoMemError, "failed to allocate a context");
+    }
+    return tctx;
+}
+
+static t_ctx_t *_ctx_ref(t_ctx_t *tctx) {
+    if (tctx)
+	tctx->refs++;
+    return tctx;
+}
+
+/* drop a reference, freeing the context with the last one. The context frees
+   itself through mem, so tctx has to stay around until it's done */
+static void _ctx_unref(t_ctx_t *tctx) {
+    if (!tctx || --tctx->refs > 0)
+	return;
+    xml_parser_pool_free(&tctx->parsers);
+    xmpp_ctx_free(tctx->ctx);
+    if (tctx->log)
+	async_log_close(tctx->log);
+    xfree(tctx);
+}
+
+/* Ruby side of a stanza. The strings handed out for name, type, id, from and to
+   are memoized on first access (Qundef means "not read yet") and handed out again
+   while the node's value still matches, so handlers can call them repeatedly
+   without allocating. Several wrappers may share a node, each checks its own.
+   The wrapper owns a reference on root, the top of the tree stanza lives in,
+   so that a node's parent and siblings stay valid as long as the wrapper does. */
+typedef struct {
+    xmpp_stanza_t *stanza;
+    xmpp_stanza_t *root;
+    VALUE name;
+    VALUE type;
+    VALUE id;
+    VALUE from;
+    VALUE to;
+} t_stanza_t;
+
+/* keep the memoized strings alive */
+static void t_xmpp_stanza_mark(void *ptr) {
+    t_stanza_t *ts = ptr;
+    rb_gc_mark(ts->name);
+    rb_gc_mark(ts->type);
+    rb_gc_mark(ts->id);
+    rb_gc_mark(ts->from);
+    rb_gc_mark(ts->to);
+}
+
+/* nodes under a tree about to be freed that something else still holds are cut out of it
+   first and become roots of their own. libstrophe would free the rest around them, leaving
+   them pointing at their freed parent and siblings */
+static void _stanza_orphan_survivors(xmpp_stanza_t *node) {
+    xmpp_stanza_t *child, *next;
+
+    for (child = node->children; child; child = next) {
+	next = child->next;
+	if (child->ref == 1) {
+	    _stanza_orphan_survivors(child);
+	    continue;
+	}
+	if (child->prev)
+	    child->prev->next = child->next;
+	else
+	    node->children = child->next;
+	if (child->next)
+	    child->next->prev = child->prev;
+	child->parent = child->prev = child->next = NULL;
+	/* the reference node held on it */
+	mem_stanza_release(child);
+    }
+}
+
+/* drop a wrapper's reference on the root of its tree */
+static void _stanza_release_root(xmpp_stanza_t *root) {
+    if (root->ref == 1)
+	_stanza_orphan_survivors(root);
+    mem_stanza_release(root);
+}
 
-/* release the stanza. Called automatically by the GC */
-static void t_xmpp_stanza_release(void *stanza) {
-    if(stanza != NULL)
-      xmpp_stanza_release(stanza);    
+/* release the stanza, then the context it came from. Called automatically by the GC */
+static void t_xmpp_stanza_release(void *ptr) {
+    t_stanza_t *ts = ptr;
+    t_ctx_t *tctx;
+    if(ts->root != NULL) {
+      tctx = _ctx_of(ts->root->ctx);
+      _stanza_release_root(ts->root);
+      tctx->stanza_wrappers--;
+      _ctx_unref(tctx);
+    }
+    xfree(ts);
+}
+
+/* native size of a tree, close enough for the GC and ObjectSpace.memsize_of */
+static size_t _stanza_tree_size(const xmpp_stanza_t *stanza) {
+    size_t size = sizeof(xmpp_stanza_t);
+    const xmpp_stanza_t *child;
+
+    if (stanza->data)
+	size += strlen(stanza->data) + 1;
+    if (stanza->attributes)
+	size += hash_num_keys((hash_t *)stanza->attributes) * 4 * sizeof(void *);
+    for (child = stanza->children; child; child = child->next)
+	size += _stanza_tree_size(child);
+    return size;
+}
+
+/* a wrapper of a child node shares its root's tree, only the root counts it */
+static size_t t_xmpp_stanza_size(const void *ptr) {
+    const t_stanza_t *ts = ptr;
+    size_t size = sizeof(t_stanza_t);
+
+    if (ts->stanza && ts->stanza == ts->root)
+	size += _stanza_tree_size(ts->stanza);
+    return size;
+}
+
+static const rb_data_type_t t_stanza_type = {
+    "StropheRuby::Stanza",
+    { t_xmpp_stanza_mark, t_xmpp_stanza_release, t_xmpp_stanza_size, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* forget every memoized accessor value */
+static void _stanza_flush_cache(t_stanza_t *ts) {
+    ts->name = ts->type = ts->id = ts->from = ts->to = Qundef;
+}
+
+/* wrap node of the tree under root, taking over the caller's reference on root. The
+   wrapper keeps the stanza's context alive, and is a good time to report native memory
+   to the GC */
+static VALUE _stanza_wrap_owned(VALUE klass, xmpp_stanza_t *node, xmpp_stanza_t *root) {
+    t_stanza_t *ts;
+    t_ctx_t *tctx = _ctx_of(root->ctx);
+    VALUE obj;
+
+    _ctx_gc_sync(tctx);
+    obj = TypedData_Make_Struct(klass, t_stanza_t, &t_stanza_type, ts);
+    ts->stanza = node;
+    ts->root = root;
+    _ctx_ref(tctx);
+    tctx->stanza_wrappers++;
+    _stanza_flush_cache(ts);
+    return obj;
+}
+
+/* wrap a stanza we hold a reference on, eg. a new one */
+static VALUE _stanza_wrap(VALUE klass, xmpp_stanza_t *stanza) {
+    return _stanza_wrap_owned(klass, stanza, stanza);
+}
+
+/* wrap a stanza someone else owns: a node of another wrapper's tree, or one libstrophe
+   passes to a handler. The wrapper takes its own reference on the root of the tree */
+static VALUE _stanza_wrap_node(xmpp_stanza_t *node) {
+    xmpp_stanza_t *root;
+
+    if (!node)
+	return Qnil;
+    for (root = node; root->parent; root = root->parent);
+    return _stanza_wrap_owned(cStanza, node, xmpp_stanza_clone(root));
+}
+
+static t_stanza_t *_get_stanza_data(VALUE obj) {
+    t_stanza_t *ts;
+    TypedData_Get_Struct(obj, t_stanza_t, &t_stanza_type, ts);
+    return ts;
+}
+
+static xmpp_stanza_t *_get_stanza(VALUE obj) {
+    return _get_stanza_data(obj)->stanza;
+}
+
+/* return the memoized string in slot, building it again unless it still matches value. Other
+   wrappers of the node may have changed it, comparing is cheaper than a new string */
+static VALUE _stanza_cached(VALUE *slot, const char *value) {
+    VALUE cached = *slot;
+
+    if (cached != Qundef) {
+	if (!value ? NIL_P(cached) :
+	    !NIL_P(cached) && (size_t)RSTRING_LEN(cached) == strlen(value) &&
+	    memcmp(RSTRING_PTR(cached), value, RSTRING_LEN(cached)) == 0)
+	    return cached;
+    }
+    *slot = value ? rb_obj_freeze(rb_str_new2(value)) : Qnil;
+    return *slot;
+}
+
+/* the memo slot caching an attribute, or NULL if that attribute isn't memoized */
+static VALUE *_stanza_attribute_slot(t_stanza_t *ts, const char *attribute) {
+    if (strcmp(attribute, "from") == 0) return &ts->from;
+    if (strcmp(attribute, "to") == 0) return &ts->to;
+    if (strcmp(attribute, "type") == 0) return &ts->type;
+    if (strcmp(attribute, "id") == 0) return &ts->id;
+    return NULL;
 }
 
 /* Initialize the strophe library */
@@ -37,66 +287,304 @@ VALUE t_xmpp_version_check(VALUE self, VALUE major, VALUE minor) {
     return INT2FIX(res);
 }
 
+/* drop the Context's reference. Called automatically by the GC */
+/* the block a log drains to */
+static void t_xmpp_ctx_mark(void *ptr) {
+    t_ctx_t *tctx = ptr;
+
+    if (tctx && tctx->log && async_log_userdata(tctx->log))
+	rb_gc_mark((VALUE)async_log_userdata(tctx->log));
+}
+
+static void t_xmpp_ctx_release(void *ptr) {
+    _ctx_unref((t_ctx_t *)ptr);
+}
+
+/* what was allocated from the context, less what the wrappers of its stanza trees and the
+   connections' send queues and parse buffers report themselves, so nothing counts twice */
+static size_t t_xmpp_ctx_size(const void *ptr) {
+    const t_ctx_t *tctx = ptr;
+    const mem_account_t *mem = &tctx->mem;
+    size_t size = mem->bytes - mem->category[MEM_STANZA] - mem->category[MEM_SEND_QUEUE];
+    xml_parser_t *parser;
+
+    for (parser = tctx->parsers.conns; parser; parser = parser->next) {
+	if (parser->userdata && size >= parser->text_cap + parser->raw.cap)
+	    size -= parser->text_cap + parser->raw.cap;
+    }
+    return sizeof(t_ctx_t) + size;
+}
+
+static const rb_data_type_t t_ctx_type = {
+    "StropheRuby::Context",
+    { t_xmpp_ctx_mark, t_xmpp_ctx_release, t_xmpp_ctx_size, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static t_ctx_t *_get_ctx_data(VALUE obj) {
+    t_ctx_t *tctx;
+    TypedData_Get_Struct(obj, t_ctx_t, &t_ctx_type, tctx);
+    if (!tctx)
+	rb_raise(rb_eArgError, "context was freed");
+    return tctx;
+}
+
+static xmpp_ctx_t *_get_ctx(VALUE obj) {
+    return _get_ctx_data(obj)->ctx;
+}
+
+/* context for stanzas parsed without one, lives as long as the process */
+static t_ctx_t *offline_ctx;
+
+static t_ctx_t *_offline_ctx(void) {
+    if (!offline_ctx)
+	offline_ctx = _ctx_new(NULL);
+    return offline_ctx;
+}
+
+/* the context of the last connection created, where Stanza.new builds by default.
+   We hold a reference, so it outlives Context#free */
+static t_ctx_t *default_ctx;
+
+static t_ctx_t *_default_ctx(void) {
+    return default_ctx ? default_ctx : _offline_ctx();
+}
+
+static void _default_ctx_set(t_ctx_t *tctx) {
+    t_ctx_t *old = default_ctx;
+
+    if (tctx == old)
+	return;
+    default_ctx = _ctx_ref(tctx);
+    if (old)
+	_ctx_unref(old);
+}
+
 /* parse the stream one time */
 VALUE t_xmpp_run_once(VALUE self, VALUE rb_ctx, VALUE timeout) {
-    xmpp_ctx_t *ctx;        
-    Data_Get_Struct(rb_ctx,xmpp_ctx_t,ctx);
-    xmpp_run_once(ctx, NUM2INT(timeout));
+    t_ctx_t *tctx = _get_ctx_data(rb_ctx);
+    event_run_once(tctx, NUM2INT(timeout));
+    _ctx_gc_sync(tctx);
     return Qtrue;        
 }
 
-/* parse the stream continuously (by calling xmpp_run_once in a while loop) */
+/* parse the stream continuously (by calling run_once in a while loop) */
 VALUE t_xmpp_run(VALUE self, VALUE rb_ctx) {
-    xmpp_ctx_t *ctx;
-    Data_Get_Struct(rb_ctx,xmpp_ctx_t,ctx);	
-    xmpp_run(ctx);
+    t_ctx_t *tctx = _get_ctx_data(rb_ctx);
+    event_run(tctx);
+    _ctx_gc_sync(tctx);
     return Qtrue;
 }
 
 /* Set a flag to indicate to our event loop that it must exit */
 VALUE t_xmpp_stop(VALUE self, VALUE rb_ctx) {
-    xmpp_ctx_t *ctx;
-    Data_Get_Struct(rb_ctx, xmpp_ctx_t, ctx);
-    xmpp_stop(ctx);
+    xmpp_stop(_get_ctx(rb_ctx));
     return Qtrue;
 }
 
-/* free the context object (because it causes segmentation error once in a while) */
+/* Drop the context. It is actually freed once the connections, parsers and stanzas
+   made from it are gone too */
 static VALUE t_xmpp_ctx_free(VALUE self) {
-  xmpp_ctx_t *ctx;
-  Data_Get_Struct(self,xmpp_ctx_t,ctx);
-  xmpp_ctx_free(ctx);
+  t_ctx_t *tctx = _get_ctx_data(self);
+  DATA_PTR(self) = NULL;
+  _ctx_unref(tctx);
+  return Qnil;
 }
 
 /* Get the status of the control loop
  TODO: Define ruby constants for the loop statuses. Currently we have to know them by heart (0 = NOTSTARTED, 1 = RUNNING, 2 = QUIT) 
 */
 static VALUE t_xmpp_get_loop_status(VALUE self) {
-	xmpp_ctx_t *ctx;
-	Data_Get_Struct(self, xmpp_ctx_t, ctx);
+	xmpp_ctx_t *ctx = _get_ctx(self);
 	return INT2FIX(ctx->loop_status);
 }
 
 /* Set the loop status. Don't call this method if you want to exit the control loop. Call xmpp_stop instead. This method
 will set the loop status at QUIT */
 static VALUE t_xmpp_set_loop_status(VALUE self, VALUE rb_loop_status) {
-	xmpp_ctx_t *ctx;
-	Data_Get_Struct(self, xmpp_ctx_t, ctx);
+	xmpp_ctx_t *ctx = _get_ctx(self);
 	ctx->loop_status=FIX2INT(rb_loop_status);
 	return rb_loop_status;
 }
 
-/* Initialize a run time context */
-VALUE t_xmpp_ctx_new(VALUE class, VALUE log_level) {
-    xmpp_log_t *log;
+/* Counters of the context's expat parser pool: parsers created, parsers reused by a new
+   connection, stream restarts done in place and parsers currently idle */
+static VALUE t_xmpp_ctx_parser_pool_stats(VALUE self) {
+    xml_parser_pool_stats_t stats;
+    VALUE hash = rb_hash_new();
+
+    xml_parser_pool_stats(&_get_ctx_data(self)->parsers, &stats);
+    rb_hash_aset(hash, ID2SYM(rb_intern("created")), ULONG2NUM(stats.created));
+    rb_hash_aset(hash, ID2SYM(rb_intern("reused")), ULONG2NUM(stats.reused));
+    rb_hash_aset(hash, ID2SYM(rb_intern("resets")), ULONG2NUM(stats.resets));
+    rb_hash_aset(hash, ID2SYM(rb_intern("idle")), INT2NUM(stats.idle));
+    return hash;
+}
+
+/* per connection: queued bytes still to write and the parser's buffers */
+static VALUE _conn_memory_stats(const t_conn_t * const tc) {
+    const char *jid = xmpp_conn_get_jid(tc->conn);
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("jid")), jid ? rb_str_new2(jid) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("send_queue_bytes")),
+		 SIZET2NUM(__atomic_load_n(&tc->send_queue.bytes, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("parser_buffer_bytes")),
+		 SIZET2NUM(tc->parser->text_cap + tc->parser->raw.cap));
+    return hash;
+}
+
+static void *_log_flush(void *arg) {
+    void **args = arg;
+    return (void *)(intptr_t)async_log_flush((async_log_t *)args[0], (int)(intptr_t)args[1]);
+}
+
+/*Wait until the messages logged so far are written out, at most timeout seconds. false if it timed out */
+static VALUE t_xmpp_ctx_flush_log(int argc, VALUE *argv, VALUE self) {
+    t_ctx_t *tctx = _get_ctx_data(self);
+    VALUE timeout;
+    void *args[2];
+
+    rb_scan_args(argc, argv, "01", &timeout);
+    args[0] = tctx->log;
+    args[1] = (void *)(intptr_t)(NIL_P(timeout) ? 1000 : (int)(NUM2DBL(timeout) * 1000));
+    return rb_thread_call_without_gvl(_log_flush, args, RUBY_UBF_IO, NULL) ? Qtrue : Qfalse;
+}
+
+/*Messages handed to the log's file or block, dropped because the queue was full, and cut short */
+static VALUE t_xmpp_ctx_log_stats(VALUE self) {
+    t_ctx_t *tctx = _get_ctx_data(self);
+    async_log_stats_t stats;
+    VALUE hash = rb_hash_new();
+
+    async_log_stats(tctx->log, &stats);
+    rb_hash_aset(hash, ID2SYM(rb_intern("written")), ULL2NUM(stats.written));
+    rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULL2NUM(stats.dropped));
+    rb_hash_aset(hash, ID2SYM(rb_intern("truncated")), ULL2NUM(stats.truncated));
+    return hash;
+}
+
+/* where the native memory of the context goes, by category and by connection. allocations counts
+   the calls to the allocator since the context was created. live_stanzas counts the nodes the
+   binding built, parsed or copied that are not freed yet, see mem_stanzas_built */
+static VALUE t_xmpp_ctx_memory_stats(VALUE self) {
+    t_ctx_t *tctx = _get_ctx_data(self);
+    mem_account_t *account = &tctx->mem;
+    t_conn_t *tc;
+    VALUE hash = rb_hash_new(), categories = rb_hash_new(), conns = rb_ary_new();
+    int i;
+
+    for (i = 0; i < MEM_CATEGORY_COUNT; i++) {
+	VALUE category = rb_hash_new();
+	rb_hash_aset(category, ID2SYM(rb_intern("bytes")), SIZET2NUM(account->category[i]));
+	rb_hash_aset(category, ID2SYM(rb_intern("peak")), SIZET2NUM(account->category_peak[i]));
+	rb_hash_aset(categories, ID2SYM(rb_intern(mem_category_name(i))), category);
+    }
+    for (tc = tctx->conns; tc; tc = tc->next)
+	rb_ary_push(conns, _conn_memory_stats(tc));
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(account->bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("peak_bytes")), SIZET2NUM(account->peak));
+    rb_hash_aset(hash, ID2SYM(rb_intern("categories")), categories);
+    rb_hash_aset(hash, ID2SYM(rb_intern("live_stanzas")), SIZET2NUM(account->stanzas));
+    rb_hash_aset(hash, ID2SYM(rb_intern("peak_live_stanzas")), SIZET2NUM(account->stanzas_peak));
+    rb_hash_aset(hash, ID2SYM(rb_intern("allocations")), SIZET2NUM(account->allocations));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stanza_wrappers")), LONG2NUM(tctx->stanza_wrappers));
+    rb_hash_aset(hash, ID2SYM(rb_intern("connections")), conns);
+    return hash;
+}
+
+/* Logging. The context logs through async_log: messages under its level are dropped
+   right away, the others are queued and written by a background thread, so the event
+   loop never waits on a slow terminal or disk. A block passed to Context.new gets them
+   instead, from a Ruby thread */
+static VALUE _log_call(VALUE args) {
+    return rb_proc_call(rb_ary_entry(args, 0), rb_ary_entry(args, 1));
+}
+
+static void *_log_wait(void *log) {
+    async_log_wait((async_log_t *)log, 100);
+    return NULL;
+}
+
+static void _log_unblock(void *log) {
+    async_log_wake((async_log_t *)log);
+}
+
+static VALUE _log_drain(VALUE ptr) {
+    async_log_t *log = (async_log_t *)ptr;
+    volatile VALUE block = (VALUE)async_log_userdata(log);
+    async_log_entry_t entry;
+    VALUE args;
+    int state;
+
+    for (;;) {
+	while (async_log_pop(log, &entry)) {
+	    args = rb_ary_new3(3, INT2FIX(entry.level), rb_str_new2(entry.area), rb_str_new2(entry.msg));
+	    rb_protect(_log_call, rb_assoc_new(block, args), &state);
+	    if (state)
+		rb_set_errinfo(Qnil);
+	    async_log_done(log);
+	}
+	if (async_log_closed(log))
+	    break;
+	rb_thread_call_without_gvl(_log_wait, log, _log_unblock, log);
+    }
+    return Qnil;
+}
+
+static VALUE _log_drain_done(VALUE ptr) {
+    async_log_unref((async_log_t *)ptr);
+    return Qnil;
+}
+
+static VALUE _log_thread(void *log) {
+    return rb_ensure(_log_drain, (VALUE)log, _log_drain_done, (VALUE)log);
+}
+
+/* where to log: stderr for nil, a file name to append to, an IO, or the block */
+static async_log_t *_log_new(xmpp_log_level_t level, VALUE target, VALUE block) {
+    async_log_t *log;
+    int fd = 2, owns_fd = 0;
+
+    if (!NIL_P(block)) {
+	fd = -1;
+    } else if (RB_TYPE_P(target, T_STRING)) {
+	fd = open(STR2CSTR(target), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+	    rb_sys_fail(STR2CSTR(target));
+	owns_fd = 1;
+    } else if (!NIL_P(target)) {
+	fd = dup(NUM2INT(rb_funcall(target, rb_intern("fileno"), 0)));
+	if (fd < 0)
+	    rb_sys_fail("dup");
+	owns_fd = 1;
+    }
+
+    if (!(log = async_log_new(level, fd, owns_fd))) {
+	if (owns_fd)
+	    close(fd);
+	rb_raise(rb_eNoMemError, "failed to allocate a log");
+    }
+    if (!NIL_P(block)) {
+	async_log_set_userdata(log, (void *)block);
+	async_log_ref(log);
+	rb_thread_create(_log_thread, log);
+    }
+    return log;
+}
+
+/* Initialize a run time context. Logs at log_level and above go to stderr, or to
+   log: a file name or an IO. Given a block, it's called with (level, area, message) instead.
+   eg. StropheRuby::Context.new(StropheRuby::Logging::DEBUG, "xmpp.log") */
+VALUE t_xmpp_ctx_new(int argc, VALUE *argv, VALUE class) {
+    VALUE log_level, target, block;
     xmpp_log_level_t level;
+    rb_scan_args(argc, argv, "11&", &log_level, &target, &block);
     level=FIX2INT(log_level);
-    log = xmpp_get_default_logger((xmpp_log_level_t)level);
-    xmpp_ctx_t *ctx = xmpp_ctx_new(NULL, log);
-    VALUE tdata = Data_Wrap_Struct(class, 0, free, ctx);
-    VALUE argv[1];
-    argv[0] = log_level;
-    rb_obj_call_init(tdata,1,argv);
+    VALUE tdata = TypedData_Wrap_Struct(class, &t_ctx_type, NULL);
+    DATA_PTR(tdata) = _ctx_new(_log_new(level, target, block));
+    rb_obj_call_init(tdata, 1, &log_level);
     return tdata;
 }
 
@@ -106,35 +594,165 @@ static VALUE t_xmpp_ctx_init(VALUE self, VALUE log_level) {
   return self;
 }
 
-/* Release the connection object. (Currently not called at all... because it causes segmentation error once in a while) */
+/* close the socket of a connection going away. This may run from the GC, _conn_handler
+   ignores the disconnect event of a connection without wrappers left */
+static void _conn_close(t_conn_t *tc) {
+    if (!tc->up)
+	return;
+    tc->up = 0;
+    conn_disconnect(tc->conn);
+}
+
+/* Stanza handlers are grouped by what they match: each (name, ns, type) gets a route, however
+   many blocks it holds. libstrophe only sees one handler per connection, _route_handler for
+   any stanza, added with the first route and deleted with the last: xmpp_handler_add takes a
+   handler function once per connection whatever its userdata, so the routes can't each have
+   an entry of their own. _route_handler picks the routes the stanza matches.
+
+   libstrophe may be walking its lists while the blocks run, so a block removed then is only
+   flagged, skipped and put on tc->removed. The arrays and libstrophe's lists are cleaned up at
+   the next safe point, conn_handlers_prune, eg. the top of the event loop */
+struct _t_route_t {
+    t_conn_t *tc;
+    char *name;  /* NULL matches any */
+    char *ns;
+    char *type;
+    VALUE handlers;
+    t_route_t *next;
+};
+
+static void _routes_free(t_conn_t *tc);
+
+/* drop one wrapper's share of the connection. The last one takes the libstrophe
+   connection down with it, its parser goes back to the context's pool from parser_free */
+static void _conn_unref(t_conn_t *tc) {
+    xmpp_conn_t *conn = tc->conn;
+    t_conn_t **link;
+
+    if (--tc->refs > 0) {
+	xmpp_conn_release(conn);
+	return;
+    }
+    _conn_close(tc);
+    for (link = &tc->tctx->conns; *link != tc; link = &(*link)->next);
+    *link = tc->next;
+    /* the parser doesn't call back into us any more */
+    tc->parser->userdata = NULL;
+    tc->parser->tap = NULL;
+    tc->parser->deliver_raw = NULL;
+    tc->parser->wants_tree = NULL;
+    tc->parser->stats = NULL;
+    tc->parser->live = 0;
+    if (tc->capture)
+	capture_close(tc->capture);
+    _routes_free(tc);
+    xmpp_conn_release(conn);
+    _ctx_unref(tc->tctx);
+    xfree(tc);
+}
+
+/* keep the handler blocks alive */
+static void _conn_mark(void *ptr) {
+    t_conn_t *tc = ptr;
+    t_route_t *route;
+
+    if (!tc)
+	return;
+    for (route = tc->routes; route; route = route->next)
+	rb_gc_mark(route->handlers);
+    rb_gc_mark(tc->id_handlers);
+    rb_gc_mark(tc->raw_handlers);
+    rb_gc_mark(tc->removed);
+    rb_gc_mark(tc->connect_block);
+    rb_gc_mark(tc->slow_block);
+}
+
+/* free the Ruby side of a connection. Called automatically by the GC */
+static void _conn_free(void *ptr) {
+    if (ptr)
+	_conn_unref((t_conn_t *)ptr);
+}
+
+static size_t _conn_size(const void *ptr) {
+    const t_conn_t *tc = ptr;
+
+    if (!tc)
+	return 0;
+    return sizeof(t_conn_t) + tc->parser->text_cap + tc->parser->raw.cap + tc->send_queue.bytes;
+}
+
+static const rb_data_type_t t_conn_type = {
+    "StropheRuby::Connection",
+    { _conn_mark, _conn_free, _conn_size, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static t_conn_t *_get_conn_data(VALUE obj) {
+    t_conn_t *tc;
+    TypedData_Get_Struct(obj, t_conn_t, &t_conn_type, tc);
+    if (!tc)
+	rb_raise(rb_eArgError, "connection was released");
+    return tc;
+}
+
+static xmpp_conn_t *_get_conn(VALUE obj) {
+    return _get_conn_data(obj)->conn;
+}
+
+/* default slow_handler_threshold, 100ms */
+#define SLOW_HANDLER_NS (100 * 1000000ULL)
+
+static void _conn_tap(xml_parser_t * const parser, const char * const buf, const size_t len);
+static void _conn_deliver(xml_parser_t * const parser, xmpp_stanza_t * const stanza);
+static int _conn_wants_tree(xml_parser_t * const parser, const char * const name);
+
+static VALUE _conn_wrap(VALUE klass, t_ctx_t *tctx, xmpp_conn_t *conn) {
+    t_conn_t *tc;
+    VALUE obj = TypedData_Make_Struct(klass, t_conn_t, &t_conn_type, tc);
+    tc->conn = conn;
+    tc->tctx = _ctx_ref(tctx);
+    tc->refs = 1;
+    tc->parser = xml_parser_of(&tctx->parsers, conn);
+    tc->parser->userdata = tc;
+    tc->parser->stats = &tc->stats;
+    tc->parser->tap = _conn_tap;
+    tc->parser->deliver = _conn_deliver;
+    tc->parser->wants_tree = _conn_wants_tree;
+    tc->next = tctx->conns;
+    tctx->conns = tc;
+    tc->connect_block = Qnil;
+    tc->slow_block = Qnil;
+    tc->slow_ns = SLOW_HANDLER_NS;
+    RB_OBJ_WRITE(obj, &tc->id_handlers, rb_hash_new());
+    RB_OBJ_WRITE(obj, &tc->raw_handlers, rb_hash_new());
+    RB_OBJ_WRITE(obj, &tc->removed, rb_ary_new());
+    return obj;
+}
+
+/* Release the connection object now rather than when the GC gets to it */
 static VALUE t_xmpp_conn_release(VALUE self) {
-  xmpp_conn_t *conn;
-  Data_Get_Struct(self,xmpp_conn_t,conn);
-  xmpp_conn_release(conn);
+  t_conn_t *tc = _get_conn_data(self);
+  DATA_PTR(self) = NULL;
+  _conn_unref(tc);
+  return Qnil;
 }
 
-/* Initialize a connection object. We register instance variables that will hold the various callbacks
-   You should not manipulate instance variables. Use add_handler instead. 
-   Maybe put this into xmpp_conn_new?
- */
+/* Initialize a connection object. The handlers live in the wrapped struct (see _conn_wrap),
+   use add_handler to register them */
 static VALUE t_xmpp_conn_init(VALUE self, VALUE ctx) {
-  rb_iv_set(self, "@ctx", ctx);  
-  rb_iv_set(self, "@presence_handlers", rb_ary_new());
-  rb_iv_set(self, "@message_handlers", rb_ary_new());
-  rb_iv_set(self, "@iq_handlers", rb_ary_new());
-  rb_iv_set(self, "@id_handlers", rb_ary_new());
-  rb_gv_set("rb_conn",self);
   return self;
 }
 
 /* create a connection object then call the initialize method for it*/
 VALUE t_xmpp_conn_new(VALUE class, VALUE rb_ctx) {
   //Get the context in a format that C can understand
-  xmpp_ctx_t *ctx;
-  Data_Get_Struct(rb_ctx, xmpp_ctx_t, ctx);
+  t_ctx_t *tctx = _get_ctx_data(rb_ctx);
   
-  xmpp_conn_t *conn = xmpp_conn_new(ctx);
-  VALUE tdata = Data_Wrap_Struct(class, 0, free, conn);
+  xmpp_conn_t *conn = xmpp_conn_new(tctx->ctx);
+  if (!conn)
+    rb_raise(rb_eNoMemError, "failed to allocate a connection");
+  VALUE tdata = _conn_wrap(class, tctx, conn);
+  _default_ctx_set(tctx);
   VALUE argv[1];
   argv[0] = rb_ctx;
   
@@ -143,24 +761,30 @@ VALUE t_xmpp_conn_new(VALUE class, VALUE rb_ctx) {
   return tdata;
 }
 
-/* Clone a connection */
+/* Clone a connection. Both objects share the connection, its parser and its handlers.
+   A write barrier only knows one parent, so shared connections give up the protection */
 static VALUE t_xmpp_conn_clone(VALUE self) {
-    xmpp_conn_t *conn = xmpp_conn_clone((xmpp_conn_t *)self);    
-    return Data_Wrap_Struct(cConnection, 0, t_xmpp_conn_release, conn);
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE clone = TypedData_Wrap_Struct(cConnection, &t_conn_type, tc);
+    rb_gc_writebarrier_unprotect(self);
+    rb_gc_writebarrier_unprotect(clone);
+    xmpp_conn_clone(tc->conn);
+    tc->refs++;
+    return clone;
 }
 
 
 /* Get the jid */
 static VALUE t_xmpp_conn_get_jid(VALUE self) {
     xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+    conn = _get_conn(self);
     return rb_str_new2(xmpp_conn_get_jid(conn));    
 }
 
 /* Set the jid */
 static VALUE t_xmpp_conn_set_jid(VALUE self, VALUE jid) {
     xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+    conn = _get_conn(self);
     xmpp_conn_set_jid(conn, STR2CSTR(jid));
     return jid;
 }
@@ -168,212 +792,1183 @@ static VALUE t_xmpp_conn_set_jid(VALUE self, VALUE jid) {
 /* get the password */
 static VALUE t_xmpp_conn_get_pass(VALUE self) {
     xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+    conn = _get_conn(self);
     return rb_str_new2(xmpp_conn_get_pass(conn));
 }
 
 /* set the password */
 static VALUE t_xmpp_conn_set_pass(VALUE self, VALUE pass) {
     xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+    conn = _get_conn(self);
     xmpp_conn_set_pass(conn, STR2CSTR(pass));
     return pass;
 }
 
     
-/* Parent handler for the connection... we call yield to invoke the client callback*/
+/* connections of the context that are connected or on their way */
+static int _ctx_connections_up(t_ctx_t *tctx) {
+    t_conn_t *tc;
+
+    for (tc = tctx->conns; tc; tc = tc->next) {
+	if (tc->up)
+	    return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    t_conn_t *tc;
+    int status;
+} conn_block_call_t;
+
+static VALUE _conn_block_enter(VALUE ptr) {
+    conn_block_call_t *c = (conn_block_call_t *)ptr;
+    return rb_funcall(c->tc->connect_block, rb_intern("call"), 1, INT2FIX(c->status));
+}
+
+static VALUE _conn_block_leave(VALUE ptr) {
+    ((conn_block_call_t *)ptr)->tc->dispatching--;
+    return Qnil;
+}
+
+/* call the connect block. libstrophe may be going through its handlers, a Handler#remove
+   from the block waits for conn_handlers_prune like one from a stanza handler */
+static void _conn_block_call(t_conn_t *tc, int status) {
+    conn_block_call_t c = { tc, status };
+
+    if (!RTEST(tc->connect_block))
+	return;
+    tc->dispatching++;
+    rb_ensure(_conn_block_enter, (VALUE)&c, _conn_block_leave, (VALUE)&c);
+}
+
+/* Parent handler for the connection... we call yield to invoke the client callback,
+   with the ConnectionEvents status whether the connection went up or down */
 static void _conn_handler(xmpp_conn_t * const conn, const xmpp_conn_event_t status, 
 		  const int error, xmpp_stream_error_t * const stream_error,
 		  void * const userdata) {
+    t_conn_t *tc = (t_conn_t *)userdata;
+    xmpp_ctx_t *ctx = tc->tctx->ctx;
+
+    /* closed by _conn_unref, nobody left to tell */
+    if (!tc->refs)
+	return;
+    tc->up = status == XMPP_CONN_CONNECT;
+    /* libstrophe fires user handlers from now on, raw ones follow suit */
+    tc->parser->authenticated = status == XMPP_CONN_CONNECT;
     if (status == XMPP_CONN_CONNECT) {
-	xmpp_info(conn->ctx, "xmpp", "Connected");
+	xmpp_info(ctx, "xmpp", "Connected");
 	  	    
 	
 	//yield code block for connection
-	if (RTEST(client_conn_handler))
-	    rb_funcall(client_conn_handler, rb_intern("call"), 1, INT2FIX(status));
+	_conn_block_call(tc, status);
 	    
     } else {    	
-	    xmpp_info(conn->ctx, "xmpp", "Disconnected");
-	    xmpp_stop(conn->ctx);
+	    xmpp_info(ctx, "xmpp", "Disconnected");
+	    _conn_block_call(tc, status);
+	    /* the loop keeps running for the other connections of the context */
+	    if (!_ctx_connections_up(tc->tctx))
+		xmpp_stop(ctx);
     }    
 }
 
-/*this is called in a loop (rb_iterate). We invoke the block passed by the user*/
-static VALUE _call_handler(VALUE obj, VALUE stanza) {
-    rb_funcall(obj, rb_intern("call"),1, stanza);
-    return Qnil;
+/* A block given to add_handler, add_id_handler or add_handler(raw: true), with the time spent
+   in it. The handler arrays of the connection hold these rather than bare procs, add_handler
+   hands them out so that Handler#remove can take them back */
+typedef enum {
+    HANDLER_STANZA,  /* in a route, see below */
+    HANDLER_ID,      /* in the id_handlers hash */
+    HANDLER_RAW      /* in the raw_handlers hash */
+} handler_list_t;
+
+typedef struct {
+    VALUE block;
+    VALUE kind;        /* what it was registered for: "message", an id, a raw element name */
+    VALUE conn;        /* the Connection it was added to */
+    handler_list_t list;
+    t_route_t *route;  /* HANDLER_STANZA only */
+    int once;          /* removed before its first call */
+    int removed;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t slow;     /* calls over the connection's slow_handler_threshold */
+} t_handler_t;
+
+static void _handler_mark(void *ptr) {
+    t_handler_t *th = ptr;
+    rb_gc_mark(th->block);
+    rb_gc_mark(th->kind);
+    rb_gc_mark(th->conn);
 }
 
-/* Called when a message is received in the stream. From there we invoke all code blocks for stanzas of type 'message'*/
-int _message_handler(xmpp_conn_t * const conn,
-		 xmpp_stanza_t * const stanza,
-		 void * const userdata) {    
-    VALUE arr;
-    VALUE rb_conn;
-    rb_conn = rb_gv_get("rb_conn");
-    VALUE rb_stanza = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, stanza);
-        
-    arr=rb_iv_get(rb_conn,"@message_handlers");
-    rb_iterate(rb_each,arr,_call_handler, rb_stanza);
-    return 1;
+static const rb_data_type_t t_handler_type = {
+    "StropheRuby::Handler",
+    { _handler_mark, RUBY_TYPED_DEFAULT_FREE, 0, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE _handler_new(VALUE conn, handler_list_t list, VALUE kind, VALUE block, int once) {
+    t_handler_t *th;
+    VALUE obj = TypedData_Make_Struct(cHandler, t_handler_t, &t_handler_type, th);
+
+    RB_OBJ_WRITE(obj, &th->block, block);
+    RB_OBJ_WRITE(obj, &th->kind, rb_str_new_frozen(kind));
+    RB_OBJ_WRITE(obj, &th->conn, conn);
+    th->list = list;
+    th->once = once;
+    return obj;
+}
+
+static t_handler_t *_get_handler(VALUE obj) {
+    t_handler_t *th;
+    TypedData_Get_Struct(obj, t_handler_t, &t_handler_type, th);
+    return th;
+}
+
+/*What the block was registered for: "message", "presence", an id or a raw element name */
+static VALUE t_handler_kind(VALUE self) {
+    return _get_handler(self)->kind;
+}
+
+/*"file:line" of the block, nil if it has none */
+static VALUE t_handler_source(VALUE self) {
+    VALUE location = rb_funcall(_get_handler(self)->block, rb_intern("source_location"), 0);
+
+    if (NIL_P(location))
+	return Qnil;
+    return rb_sprintf("%"PRIsVALUE":%"PRIsVALUE, rb_ary_entry(location, 0), rb_ary_entry(location, 1));
 }
 
-/* Called when a presence is received in the stream. From there we invoke all code blocks for stanzas of type 'presence'*/
-int _presence_handler(xmpp_conn_t * const conn,
-		 xmpp_stanza_t * const stanza,
-		 void * const userdata) {
+/*Calls, total, max and mean time in seconds, and calls over the slow handler threshold */
+static VALUE t_handler_stats(VALUE self) {
+    t_handler_t *th = _get_handler(self);
+    VALUE hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("kind")), th->kind);
+    rb_hash_aset(hash, ID2SYM(rb_intern("source")), t_handler_source(self));
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULL2NUM(th->calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("total")), DBL2NUM(th->total_ns / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max")), DBL2NUM(th->max_ns / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("mean")), DBL2NUM(th->calls ? th->total_ns / 1e9 / th->calls : 0.0));
+    rb_hash_aset(hash, ID2SYM(rb_intern("slow")), ULL2NUM(th->slow));
+    return hash;
+}
+
+static int _route_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata);
+static int _id_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata);
+
+static int _key_equal(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static t_route_t *_route_find(t_conn_t *tc, const char *name, const char *ns, const char *type) {
+    t_route_t *route;
+
+    for (route = tc->routes; route; route = route->next) {
+	if (_key_equal(route->name, name) && _key_equal(route->ns, ns) && _key_equal(route->type, type))
+	    return route;
+    }
+    return NULL;
+}
+
+/* libstrophe's handler for the routes of tc, from the first route on */
+static void _route_register(t_conn_t *tc) {
+    mem_scope_t scope;
+
+    if (tc->routes)
+	return;
+    scope = _mem_scope(tc->tctx->ctx, MEM_HANDLER);
+    xmpp_handler_add(tc->conn, _route_handler, NULL, NULL, NULL, tc);
+    mem_scope_leave(scope);
+}
+
+static void _route_free(t_route_t *route) {
+    xfree(route->name);
+    xfree(route->ns);
+    xfree(route->type);
+    xfree(route);
+}
+
+/* forget a route with no blocks left, and libstrophe's handler with the last one */
+static void _route_drop(t_route_t *route) {
+    t_conn_t *tc = route->tc;
+    t_route_t **link;
+
+    for (link = &tc->routes; *link != route; link = &(*link)->next);
+    *link = route->next;
+    _route_free(route);
+    if (!tc->routes)
+	xmpp_handler_delete(tc->conn, _route_handler);
+}
+
+/* at the end of the connection, its libstrophe lists may outlive it */
+static void _routes_free(t_conn_t *tc) {
+    t_route_t *route, *next;
+
+    if (tc->routes)
+	xmpp_handler_delete(tc->conn, _route_handler);
+    for (route = tc->routes; route; route = next) {
+	next = route->next;
+	_route_free(route);
+    }
+    tc->routes = NULL;
+}
+
+/* take a removed handler out of its array, and the array's registration with it once empty */
+static void _handler_unlink(t_conn_t *tc, VALUE handler) {
+    t_handler_t *th = _get_handler(handler);
     VALUE arr;
-    VALUE rb_conn;
-    rb_conn = rb_gv_get("rb_conn");
-    VALUE rb_stanza = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, stanza);
-        
-    arr=rb_iv_get(rb_conn,"@presence_handlers");
-    rb_iterate(rb_each,arr,_call_handler, rb_stanza);
+
+    switch (th->list) {
+    case HANDLER_STANZA:
+	rb_ary_delete(th->route->handlers, handler);
+	if (RARRAY_LEN(th->route->handlers) == 0)
+	    _route_drop(th->route);
+	th->route = NULL;
+	break;
+    case HANDLER_ID:
+	arr = rb_hash_aref(tc->id_handlers, th->kind);
+	if (NIL_P(arr))
+	    break;
+	rb_ary_delete(arr, handler);
+	if (RARRAY_LEN(arr) == 0) {
+	    rb_hash_delete(tc->id_handlers, th->kind);
+	    xmpp_id_handler_delete(tc->conn, _id_handler, RSTRING_PTR(th->kind));
+	}
+	break;
+    case HANDLER_RAW:
+	arr = rb_hash_aref(tc->raw_handlers, th->kind);
+	if (NIL_P(arr))
+	    break;
+	rb_ary_delete(arr, handler);
+	if (RARRAY_LEN(arr) == 0) {
+	    rb_hash_delete(tc->raw_handlers, th->kind);
+	    xml_parser_remove_raw(tc->parser, RSTRING_PTR(th->kind));
+	}
+	break;
+    }
+}
+
+/* stop calling a handler, 0 if it was removed already */
+static int _handler_detach(t_conn_t *tc, VALUE handler) {
+    t_handler_t *th = _get_handler(handler);
+
+    if (th->removed)
+	return 0;
+    th->removed = 1;
+    if (tc->dispatching) {
+	rb_ary_push(tc->removed, handler);
+	tc->prune = 1;
+    } else {
+	_handler_unlink(tc, handler);
+    }
     return 1;
 }
 
-/* Called when a iq is received in the stream. From there we invoke all code blocks for stanzas of type 'iq'*/
-int _iq_handler(xmpp_conn_t * const conn,
-		 xmpp_stanza_t * const stanza,
-		 void * const userdata) {
-    VALUE arr;
-    VALUE rb_conn;
-    rb_conn = rb_gv_get("rb_conn");
-    VALUE rb_stanza = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, stanza);
-        
-    arr=rb_iv_get(rb_conn,"@iq_handlers");
-    rb_iterate(rb_each,arr,_call_handler, rb_stanza);
+/* finish removing the handlers removed while blocks were running. Not from a block */
+void conn_handlers_prune(t_conn_t *tc) {
+    long i;
+
+    tc->prune = 0;
+    for (i = 0; i < RARRAY_LEN(tc->removed); i++)
+	_handler_unlink(tc, RARRAY_AREF(tc->removed, i));
+    rb_ary_clear(tc->removed);
+}
+
+/*Stop calling the block. Returns false if it was removed already */
+static VALUE t_handler_remove(VALUE self) {
+    t_handler_t *th = _get_handler(self);
+
+    return _handler_detach(_get_conn_data(th->conn), self) ? Qtrue : Qfalse;
+}
+
+/*true once removed, by remove or after its one call with once: true */
+static VALUE t_handler_removed(VALUE self) {
+    return _get_handler(self)->removed ? Qtrue : Qfalse;
+}
+
+/* a block took longer than the threshold: tell on_slow_handler, or log a warning */
+static void _handler_slow(t_conn_t *tc, VALUE handler, uint64_t ns) {
+    t_handler_t *th = _get_handler(handler);
+    VALUE source;
+
+    th->slow++;
+    if (RTEST(tc->slow_block)) {
+	rb_funcall(tc->slow_block, id_call, 2, handler, DBL2NUM(ns / 1e9));
+	return;
+    }
+    source = t_handler_source(handler);
+    xmpp_warn(tc->tctx->ctx, "xmpp", "slow %s handler at %s took %.1f ms", RSTRING_PTR(th->kind),
+	      NIL_P(source) ? "?" : RSTRING_PTR(source), ns / 1e6);
+}
+
+typedef struct {
+    t_conn_t *tc;
+    VALUE arr;  /* Handlers, or the connect block */
+    VALUE arg;
+} dispatch_t;
+
+/* invoke the handlers in arr, timing each block, the whole lot and the wait since the chunk
+   was read for Connection#stats and #handler_stats. Each block's end is the next one's start,
+   so that's one clock read per block. Blocks added meanwhile wait for the next stanza, the
+   array doesn't shrink until conn_handlers_prune */
+static VALUE _dispatch_blocks(VALUE ptr) {
+    dispatch_t *d = (dispatch_t *)ptr;
+    t_conn_t *tc = d->tc;
+    long i, len = RARRAY_LEN(d->arr);
+    uint64_t start, before, now;
+    t_handler_t *th;
+    VALUE handler;
+
+    start = now = stats_now();
+    if (tc->stats.read_at)
+	stats_hist_record(&tc->stats.dispatch_latency, start - tc->stats.read_at);
+    PROBE_HANDLER_START(tc->conn, len);
+    for (i = 0; i < len; i++) {
+	handler = RARRAY_AREF(d->arr, i);
+	th = _get_handler(handler);
+	if (th->removed)
+	    continue;
+	if (th->once)
+	    _handler_detach(tc, handler);
+	before = now;
+	rb_funcall(th->block, id_call, 1, d->arg);
+	now = stats_now();
+
+	th->calls++;
+	th->total_ns += now - before;
+	if (now - before > th->max_ns)
+	    th->max_ns = now - before;
+	if (tc->slow_ns && now - before > tc->slow_ns) {
+	    _handler_slow(tc, handler, now - before);
+	    now = stats_now();
+	}
+    }
+    PROBE_HANDLER_DONE(tc->conn, len);
+    stats_hist_record(&tc->stats.handler_time, now - start);
+    return Qnil;
+}
+
+static VALUE _dispatch_leave(VALUE ptr) {
+    ((dispatch_t *)ptr)->tc->dispatching--;
+    return Qnil;
+}
+
+static void _dispatch(t_conn_t *tc, VALUE arr, VALUE arg) {
+    dispatch_t d = { tc, arr, arg };
+
+    if (RARRAY_LEN(arr) == 0)
+	return;
+    tc->dispatching++;
+    rb_ensure(_dispatch_blocks, (VALUE)&d, _dispatch_leave, (VALUE)&d);
+}
+
+/* does the route take this stanza? The rules of handler_fire_stanza */
+static int _route_match(t_route_t *route, xmpp_stanza_t * const stanza) {
+    char *ns = xmpp_stanza_get_ns(stanza);
+    char *name = xmpp_stanza_get_name(stanza);
+    char *type = xmpp_stanza_get_type(stanza);
+
+    return (!route->ns || (ns && strcmp(ns, route->ns) == 0) ||
+	    xmpp_stanza_get_child_by_ns(stanza, route->ns)) &&
+	(!route->name || (name && strcmp(name, route->name) == 0)) &&
+	(!route->type || (type && strcmp(type, route->type) == 0));
+}
+
+/* run the routes from route on that take the stanza, oldest first like libstrophe's list */
+static void _routes_fire(t_route_t *route, xmpp_stanza_t * const stanza) {
+    if (!route)
+	return;
+    _routes_fire(route->next, stanza);
+    if (_route_match(route, stanza))
+	_dispatch(route->tc, route->handlers, _stanza_wrap_node(stanza));
+}
+
+/* Called for every stanza received in the stream while there are routes. From there we invoke
+   the code blocks of the routes matching its name, ns and type */
+static int _route_handler(xmpp_conn_t * const conn,
+			  xmpp_stanza_t * const stanza,
+			  void * const userdata) {
+    _routes_fire(((t_conn_t *)userdata)->routes, stanza);
     return 1;
 }
 
-/* Called when a id stanza is received TODO: Test this!*/
-int _id_handler(xmpp_conn_t * const conn,
-		 xmpp_stanza_t * const stanza,
-		 void * const userdata) {
-    VALUE arr;
-    VALUE rb_conn;
-    rb_conn = rb_gv_get("rb_conn");
-    VALUE rb_stanza = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, stanza);
-        
-    arr=rb_iv_get(rb_conn,"@id_handlers");
-    rb_iterate(rb_each,arr,_call_handler, rb_stanza);
+/* Called when a stanza with an id we have handlers for is received */
+static int _id_handler(xmpp_conn_t * const conn,
+		       xmpp_stanza_t * const stanza,
+		       void * const userdata) {
+    t_conn_t *tc = (t_conn_t *)userdata;
+    char *id = xmpp_stanza_get_id(stanza);
+    VALUE arr = id ? rb_hash_aref(tc->id_handlers, rb_str_new2(id)) : Qnil;
+
+    if (!NIL_P(arr))
+	_dispatch(tc, arr, _stanza_wrap_node(stanza));
     return 1;
 }
 
+/* a stanza from an offline parser: the handlers run as libstrophe would run them, id
+   handlers first */
+static void _conn_deliver(xml_parser_t * const parser, xmpp_stanza_t * const stanza) {
+    t_conn_t *tc = (t_conn_t *)parser->userdata;
+
+    PROBE_DISPATCH_START(tc->conn, stanza->data, tc->stats.read_at);
+    _id_handler(tc->conn, stanza, tc);
+    _routes_fire(tc->routes, stanza);
+    PROBE_DISPATCH_DONE(tc->conn, stanza->data);
+    mem_stanza_release(stanza);
+}
+
+/* whether a raw element also needs its tree: a route for its name, or pending id handlers */
+static int _conn_wants_tree(xml_parser_t * const parser, const char * const name) {
+    t_conn_t *tc = (t_conn_t *)parser->userdata;
+    t_route_t *route;
+
+    if (RHASH_SIZE(tc->id_handlers) > 0)
+	return 1;
+    for (route = tc->routes; route; route = route->next) {
+	if (!route->name || strcmp(route->name, name) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+/* what libstrophe reads off the socket for the connection, before it is parsed, and its
+   stream restarts (buf NULL) */
+static void _conn_tap(xml_parser_t * const parser, const char * const buf, const size_t len) {
+    t_conn_t *tc = (t_conn_t *)parser->userdata;
+
+    if (!buf) {
+	if (tc->capture)
+	    capture_write(tc->capture, CAPTURE_RESET, NULL, 0);
+	return;
+    }
+    PROBE_READ(tc->conn, len);
+    if (tc->capture)
+	capture_write(tc->capture, CAPTURE_IN, buf, len);
+    stats_add(&tc->stats.bytes_read, len);
+    tc->stats.read_at = stats_now();
+}
+
+
+/* Called by the parser with the bytes of a toplevel element registered as raw. We invoke all the raw
+   code blocks for that name with a StropheRuby::RawStanza */
+static void _raw_handler(xml_parser_t * const parser,
+			 const char * const xml, const size_t len,
+			 const char * const name, const char * const type,
+			 const char * const from) {
+    t_conn_t *tc = (t_conn_t *)parser->userdata;
+    VALUE rb_name = name ? rb_str_new2(name) : Qnil;
+    VALUE arr = rb_hash_aref(tc->raw_handlers, rb_name);
+    VALUE raw;
+
+    if (NIL_P(arr))
+	return;
+    raw = rb_struct_new(cRawStanza, rb_obj_freeze(rb_utf8_str_new(xml, len)), rb_name,
+			type ? rb_str_new2(type) : Qnil, from ? rb_str_new2(from) : Qnil);
+    _dispatch(tc, arr, raw);
+}
+
+/* Register a raw handler: the block gets a RawStanza with the serialized bytes of each matching toplevel
+   element, sliced out of the read buffer. No stanza tree is built unless another handler needs one */
+static VALUE _raw_handler_add(VALUE self, VALUE rb_name, int once) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE arr = rb_hash_aref(tc->raw_handlers, rb_name);
+    VALUE handler;
 
-/* Add an handler for events in the stream (message, presence or iqs), We store the block we just received in the correct instance variable
- to invoke it later*/
-static VALUE t_xmpp_handler_add(VALUE self,VALUE rb_name) {    
-    xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);    
     char *name = STR2CSTR(rb_name);
-    VALUE arr;
-    xmpp_handler handler;
-    
-    if(strcmp(name,"message") == 0) {
-	arr = rb_iv_get(self, "@message_handlers");	
-	handler = _message_handler;
-    } else {
-	if(strcmp(name,"presence") == 0) {
-	    arr = rb_iv_get(self, "@presence_handlers");
-	    handler = _presence_handler;
-	} else {
-	    arr = rb_iv_get(self, "@iq_handlers");
-	    handler = _iq_handler;
-	}
+    mem_scope_t scope = _mem_scope(tc->tctx->ctx, MEM_HANDLER);
+    int added = xml_parser_add_raw(tc->parser, name);
+
+    mem_scope_leave(scope);
+    if (!added)
+	rb_raise(rb_eNoMemError, "could not register raw handler");
+    tc->parser->deliver_raw = _raw_handler;
+    if (NIL_P(arr)) {
+	arr = rb_ary_new();
+	rb_hash_aset(tc->raw_handlers, rb_str_new_frozen(rb_name), arr);
     }
+    handler = _handler_new(self, HANDLER_RAW, rb_name, rb_block_proc(), once);
+    rb_ary_push(arr, handler);
+    return handler;
+}
 
-    xmpp_handler_add(conn, handler, NULL, name, NULL, conn->ctx);
-    rb_ary_push(arr, rb_block_proc());        
-    return Qnil;
+static char *_opt_str(VALUE opts, const char *key) {
+    VALUE value = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+    return NIL_P(value) ? NULL : STR2CSTR(value);
 }
 
-/* Add an handler for ID stanzas. TODO:Test this!*/
-static VALUE t_xmpp_id_handler_add(VALUE self, VALUE rb_id) {
-    xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);    
+/* Add an handler for events in the stream (message, presence or iqs), eg. add_handler("message", type: "chat").
+   ns: and type: narrow it down further, with once: true the block is removed after its first call. Returns the
+   Handler, Handler#remove takes it off. With raw: true the block receives a RawStanza instead of a Stanza
+   (see _raw_handler_add) */
+static VALUE t_xmpp_handler_add(int argc, VALUE *argv, VALUE self) {    
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE rb_name, opts, handler;
+    t_route_t *route;
+    int once;
+
+    rb_scan_args(argc, argv, "1:", &rb_name, &opts);
+    once = !NIL_P(opts) && RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("once"))));
+    if (!NIL_P(opts) && RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("raw")))))
+	return _raw_handler_add(self, rb_name, once);
+
+    char *name = STR2CSTR(rb_name);
+    char *ns = _opt_str(opts, "ns");
+    char *type = _opt_str(opts, "type");
+    
+    if (!tc->dispatching && tc->prune)
+	conn_handlers_prune(tc);
+    if (!(route = _route_find(tc, name, ns, type))) {
+	route = ALLOC(t_route_t);
+	route->tc = tc;
+	route->name = ruby_strdup(name);
+	route->ns = ns ? ruby_strdup(ns) : NULL;
+	route->type = type ? ruby_strdup(type) : NULL;
+	route->handlers = Qnil;
+	_route_register(tc);
+	RB_OBJ_WRITE(self, &route->handlers, rb_ary_new());
+	route->next = tc->routes;
+	tc->routes = route;
+    }
+    handler = _handler_new(self, HANDLER_STANZA, rb_name, rb_block_proc(), once);
+    _get_handler(handler)->route = route;
+    rb_ary_push(route->handlers, handler);
+    return handler;
+}
+
+/* Add an handler for the stanza with this id, eg. the answer to an iq. once: true removes it after
+   the first call. Returns the Handler */
+static VALUE t_xmpp_id_handler_add(int argc, VALUE *argv, VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    xmpp_conn_t *conn = tc->conn;
+    VALUE rb_id, opts, arr, handler;
+    int once;
+
+    rb_scan_args(argc, argv, "1:", &rb_id, &opts);
+    once = !NIL_P(opts) && RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("once"))));
     char *id = STR2CSTR(rb_id);
-    VALUE arr;
     
-    arr = rb_iv_get(self, "@id_handlers");
-    rb_ary_push(arr, rb_block_proc());
-    xmpp_id_handler_add(conn, _id_handler, STR2CSTR(id), conn->ctx);
-    return Qnil;
+    if (!tc->dispatching && tc->prune)
+	conn_handlers_prune(tc);
+    handler = _handler_new(self, HANDLER_ID, rb_id, rb_block_proc(), once);
+    arr = rb_hash_aref(tc->id_handlers, rb_id);
+    if (NIL_P(arr)) {
+	arr = rb_ary_new();
+	rb_hash_aset(tc->id_handlers, _get_handler(handler)->kind, arr);
+	/* an entry in libstrophe's id handler table */
+	mem_scope_t scope = _mem_scope(tc->tctx->ctx, MEM_HASH);
+	xmpp_id_handler_add(conn, _id_handler, id, tc);
+	mem_scope_leave(scope);
+    }
+    rb_ary_push(arr, handler);
+    return handler;
 }
 
-/* Connect and authenticate. We store the block in the client_conn_handler variable to invoke it later*/
-static VALUE t_xmpp_connect_client(VALUE self) {
-    xmpp_conn_t *conn;
-    xmpp_ctx_t *ctx;
-    Data_Get_Struct(rb_iv_get(self, "@ctx"), xmpp_ctx_t, ctx);    
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+static void _handlers_stats(VALUE arr, VALUE list) {
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(arr); i++) {
+	if (!_get_handler(RARRAY_AREF(arr, i))->removed)
+	    rb_ary_push(list, t_handler_stats(RARRAY_AREF(arr, i)));
+    }
+}
+
+static int _handlers_stats_i(VALUE key, VALUE arr, VALUE list) {
+    _handlers_stats(arr, list);
+    return ST_CONTINUE;
+}
+
+/*Time spent in each block registered on the connection, see Handler#stats */
+static VALUE t_xmpp_conn_handler_stats(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE list = rb_ary_new(), routes = rb_ary_new();
+    t_route_t *route;
+    long i;
+
+    /* oldest route first */
+    for (route = tc->routes; route; route = route->next)
+	rb_ary_unshift(routes, route->handlers);
+    for (i = 0; i < RARRAY_LEN(routes); i++)
+	_handlers_stats(RARRAY_AREF(routes, i), list);
+    rb_hash_foreach(tc->id_handlers, _handlers_stats_i, list);
+    rb_hash_foreach(tc->raw_handlers, _handlers_stats_i, list);
+    return list;
+}
+
+/*Blocks running longer than this many seconds are reported to on_slow_handler, or logged
+  as a warning. nil or 0 turns it off, the default is 0.1 */
+static VALUE t_xmpp_conn_set_slow_threshold(VALUE self, VALUE seconds) {
+    t_conn_t *tc = _get_conn_data(self);
+
+    tc->slow_ns = NIL_P(seconds) ? 0 : (uint64_t)(NUM2DBL(seconds) * 1e9);
+    return seconds;
+}
+
+static VALUE t_xmpp_conn_get_slow_threshold(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    return tc->slow_ns ? DBL2NUM(tc->slow_ns / 1e9) : Qnil;
+}
+
+/*Call the block with the Handler and the seconds it took when a block is slow, instead of
+  logging a warning. Without a block, go back to logging */
+static VALUE t_xmpp_conn_on_slow_handler(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+
+    RB_OBJ_WRITE(self, &tc->slow_block, rb_block_given_p() ? rb_block_proc() : Qnil);
+    return self;
+}
+
+/* Connect and authenticate. We keep the block in the connection to invoke it later.
+   host and port override the server found from the jid's domain, eg. connect("127.0.0.1", 5222) */
+static VALUE t_xmpp_connect_client(int argc, VALUE *argv, VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE rb_host, rb_port;
+    const char *host;
+    unsigned short port;
+
+    rb_scan_args(argc, argv, "02", &rb_host, &rb_port);
+    host = NIL_P(rb_host) ? NULL : STR2CSTR(rb_host);
+    port = NIL_P(rb_port) ? 0 : (unsigned short)NUM2UINT(rb_port);
     
     /*The user might have passed a block... however we don't want to invoke it right now.
     We store it to invoke it later in _xmpp_conn_handler */
     if (rb_block_given_p())
-	client_conn_handler = rb_block_proc();
+	RB_OBJ_WRITE(self, &tc->connect_block, rb_block_proc());
     
-    int result = xmpp_connect_client(conn, NULL, 0, _conn_handler, ctx);
+    stats_add(&tc->stats.connects, 1);
+
+    /* libstrophe only resets the parser on stream restarts, start from a fresh one even if
+       feed was used offline or the connection was up before */
+    _conn_tap(tc->parser, NULL, 0);
+    if (!xml_parser_reset(tc->parser))
+	rb_raise(rb_eNoMemError, "could not reset the parser");
+    tc->parser->live = 1;
+    tc->parser->authenticated = 0;
+
+    int result = xmpp_connect_client(tc->conn, host, port, _conn_handler, tc);
+    tc->up = result == 0;
     return INT2FIX(result);
 }
 
+/* parse bytes as if they had been read from the socket, raising on a parse error */
+static void _conn_feed(t_conn_t *tc, const char *data, const long len) {
+    int ok;
+
+    if (!tc->up) {
+	/* nothing authenticates an offline connection, let the user handlers run */
+	tc->parser->live = 0;
+	tc->parser->authenticated = 1;
+    }
+    stats_add(&tc->stats.bytes_read, len);
+    tc->stats.read_at = stats_now();
+    PROBE_PARSE_START(tc->conn, len);
+    ok = xml_parser_feed(tc->parser, data, len);
+    PROBE_PARSE_DONE(tc->conn, len, ok);
+    if (tc->prune && !tc->dispatching)
+	conn_handlers_prune(tc);
+    if (!ok) {
+	if (tc->parser->limits.aborted)
+	    rb_raise(rb_eArgError, "stanza over the %s limit",
+		     xml_parser_limit_name(tc->parser->limits.exceeded));
+	rb_raise(rb_eArgError, "XML parse error: %s",
+		 XML_ErrorString(XML_GetErrorCode(tc->parser->expat)));
+    }
+}
+
+/* Push bytes through the connection's parser as if they had been read from the socket.
+   On a connection that isn't connected the data is parsed as a stream of its own and every
+   complete stanza is dispatched to the handlers, eg. to replay captured traffic */
+static VALUE t_xmpp_conn_feed(VALUE self, VALUE data) {
+    t_conn_t *tc = _get_conn_data(self);
+    
+    StringValue(data);
+    _conn_feed(tc, RSTRING_PTR(data), RSTRING_LEN(data));
+    _ctx_gc_sync(tc->tctx);
+    return self;
+}
+
+/* Record the plaintext the connection reads and writes, with timestamps, appending to the
+   file at path (see capture.h). Replaces a capture already running */
+static VALUE t_xmpp_conn_start_capture(VALUE self, VALUE rb_path) {
+    t_conn_t *tc = _get_conn_data(self);
+    char *path = STR2CSTR(rb_path);
+    capture_t *capture = capture_open(path);
+
+    if (!capture)
+	rb_sys_fail(path);
+    if (tc->capture)
+	capture_close(tc->capture);
+    tc->capture = capture;
+    return self;
+}
+
+/* Stop recording, nil if there was no capture. Raises if writing the file failed at some point */
+static VALUE t_xmpp_conn_stop_capture(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    capture_t *capture = tc->capture;
+    VALUE hash;
+
+    if (!capture)
+	return Qnil;
+    tc->capture = NULL;
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("records")), ULL2NUM(capture->records));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(capture->bytes));
+    if (!capture_close(capture))
+	rb_raise(rb_eIOError, "capture incomplete, a write failed");
+    return hash;
+}
+
+typedef struct {
+    t_conn_t *tc;
+    capture_reader_t reader;
+    double speed;  /* 0 for as fast as possible */
+    uint64_t records, bytes_in, bytes_out;
+} replay_t;
+
+static VALUE _replay(VALUE ptr) {
+    replay_t *replay = (replay_t *)ptr;
+    t_conn_t *tc = replay->tc;
+    capture_record_t record;
+    uint64_t started = stats_now(), due = 0, now;
+    struct timeval wait;
+    int ret;
+
+    while ((ret = capture_reader_next(&replay->reader, &record)) > 0) {
+	replay->records++;
+	if (replay->speed > 0) {
+	    due += (uint64_t)(record.delta / replay->speed);
+	    now = stats_now() - started;
+	    if (due > now) {
+		wait.tv_sec = (due - now) / 1000000000;
+		wait.tv_usec = (due - now) % 1000000000 / 1000;
+		rb_thread_wait_for(wait);
+	    }
+	}
+	switch (record.kind) {
+	case CAPTURE_IN:
+	    replay->bytes_in += record.len;
+	    _conn_feed(tc, record.data, record.len);
+	    break;
+	case CAPTURE_OUT:
+	    /* nothing to send it to */
+	    replay->bytes_out += record.len;
+	    break;
+	case CAPTURE_RESET:
+	    if (!xml_parser_reset(tc->parser))
+		rb_raise(rb_eNoMemError, "could not reset the parser");
+	    break;
+	}
+    }
+    if (ret < 0)
+	rb_raise(rb_eArgError, "capture corrupt or cut short after %llu records",
+		 (unsigned long long)replay->records);
+    return Qnil;
+}
+
+static VALUE _replay_close(VALUE ptr) {
+    replay_t *replay = (replay_t *)ptr;
+
+    capture_reader_close(&replay->reader);
+    _ctx_gc_sync(replay->tc->tctx);
+    return Qnil;
+}
+
+/* Feed a capture through the parser and handlers as if it were coming off the socket, on a
+   connection that isn't connected. Outgoing data is skipped. speed 1.0 keeps the recorded pace,
+   2.0 doubles it, nil goes as fast as possible */
+static VALUE t_xmpp_conn_replay(int argc, VALUE *argv, VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE rb_path, rb_speed, hash;
+    replay_t replay;
+    uint64_t started = stats_now();
+    char *path;
+    int ret;
+
+    rb_scan_args(argc, argv, "11", &rb_path, &rb_speed);
+    path = STR2CSTR(rb_path);
+    if (tc->up)
+	rb_raise(rb_eArgError, "can't replay on a connected connection");
+    memset(&replay, 0, sizeof(replay));
+    replay.tc = tc;
+    replay.speed = NIL_P(rb_speed) ? 0 : NUM2DBL(rb_speed);
+    if ((ret = capture_reader_open(&replay.reader, path)) == -1)
+	rb_sys_fail(path);
+    if (ret == -2)
+	rb_raise(rb_eArgError, "%s is not a capture", path);
+    rb_ensure(_replay, (VALUE)&replay, _replay_close, (VALUE)&replay);
+
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("records")), ULL2NUM(replay.records));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_in")), ULL2NUM(replay.bytes_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_out")), ULL2NUM(replay.bytes_out));
+    rb_hash_aset(hash, ID2SYM(rb_intern("seconds")), DBL2NUM((stats_now() - started) / 1e9));
+    return hash;
+}
+
+static VALUE _limit_key(xml_parser_limit_t limit) {
+    return ID2SYM(rb_intern(xml_parser_limit_name(limit)));
+}
+
+/* Set limits on incoming stanzas. eg. conn.limits = {:bytes => 65536, :depth => 16, :children => 1000,
+   :attributes => 64, :action => :drop}. Limits left out are unchanged, nil or 0 removes one.
+   A stanza over a limit is dropped with :action => :drop, with :abort (the default) the stream
+   is closed with a policy-violation stream error */
+static VALUE t_xmpp_conn_set_limits(VALUE self, VALUE limits) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE value, action;
+    int i;
+
+    Check_Type(limits, T_HASH);
+    for (i = 0; i < XML_PARSER_LIMIT_COUNT; i++) {
+	value = rb_hash_lookup2(limits, _limit_key(i), Qundef);
+	if (value == Qundef)
+	    continue;
+	xml_parser_set_limit(tc->parser, i, NIL_P(value) ? 0 : NUM2ULONG(value));
+    }
+
+    action = rb_hash_aref(limits, ID2SYM(rb_intern("action")));
+    if (action == ID2SYM(rb_intern("drop")))
+	tc->parser->limits.action = XML_PARSER_LIMIT_DROP;
+    else if (action == ID2SYM(rb_intern("abort")))
+	tc->parser->limits.action = XML_PARSER_LIMIT_ABORT;
+    else if (!NIL_P(action))
+	rb_raise(rb_eArgError, "unknown limit action, expected :drop or :abort");
+    return limits;
+}
+
+/* The limits in effect, see limits= */
+static VALUE t_xmpp_conn_get_limits(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE limits = rb_hash_new();
+    int i;
+
+    for (i = 0; i < XML_PARSER_LIMIT_COUNT; i++) {
+	if (tc->parser->limits.max[i])
+	    rb_hash_aset(limits, _limit_key(i), ULONG2NUM(tc->parser->limits.max[i]));
+    }
+    rb_hash_aset(limits, ID2SYM(rb_intern("action")),
+		 ID2SYM(rb_intern(tc->parser->limits.action == XML_PARSER_LIMIT_DROP ? "drop" : "abort")));
+    return limits;
+}
+
+/* How many stanzas went over each limit */
+static VALUE t_xmpp_conn_get_limit_hits(VALUE self) {
+    t_conn_t *tc = _get_conn_data(self);
+    VALUE hits = rb_hash_new();
+    int i;
+
+    for (i = 0; i < XML_PARSER_LIMIT_COUNT; i++)
+	rb_hash_aset(hits, _limit_key(i), ULONG2NUM(tc->parser->limits.hits[i]));
+    return hits;
+}
+
+/* Connection#stats and Context#stats. Durations are Float seconds */
+#define NS2SEC(ns) DBL2NUM((double)(ns) / 1e9)
+
+static const double stats_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char * const stats_quantile_keys[] = { "p50", "p90", "p99", "p999" };
+#define STATS_QUANTILES (sizeof(stats_quantiles) / sizeof(stats_quantiles[0]))
+
+static VALUE _hist_to_hash(const stats_hist_t *hist) {
+    VALUE hash = rb_hash_new();
+    size_t i;
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("count")), ULL2NUM(hist->count));
+    rb_hash_aset(hash, ID2SYM(rb_intern("sum")), NS2SEC(hist->sum));
+    rb_hash_aset(hash, ID2SYM(rb_intern("min")), NS2SEC(hist->min));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max")), NS2SEC(hist->max));
+    rb_hash_aset(hash, ID2SYM(rb_intern("mean")),
+		 NS2SEC(hist->count ? hist->sum / hist->count : 0));
+    for (i = 0; i < STATS_QUANTILES; i++)
+	rb_hash_aset(hash, ID2SYM(rb_intern(stats_quantile_keys[i])),
+		     NS2SEC(stats_hist_percentile(hist, stats_quantiles[i])));
+    return hash;
+}
+
+static VALUE _stats_to_hash(const stats_conn_t *stats) {
+    VALUE hash = rb_hash_new(), kinds = rb_hash_new();
+    const stats_kind_t *kind;
+    int i;
+
+    for (i = 0; i < stats->nkinds; i++) {
+	VALUE counts = rb_hash_new();
+	kind = &stats->kinds[i];
+	rb_hash_aset(counts, ID2SYM(rb_intern("in")), ULL2NUM(kind->in));
+	rb_hash_aset(counts, ID2SYM(rb_intern("out")), ULL2NUM(kind->out));
+	rb_hash_aset(kinds, rb_assoc_new(rb_str_new2(kind->name),
+					 kind->type[0] ? rb_str_new2(kind->type) : Qnil), counts);
+    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_read")), ULL2NUM(stats->bytes_read));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_written")), ULL2NUM(stats->bytes_written));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stanzas_in")), ULL2NUM(stats->stanzas_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stanzas_out")), ULL2NUM(stats->stanzas_out));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stanzas")), kinds);
+    rb_hash_aset(hash, ID2SYM(rb_intern("send_queue_peak_bytes")), ULL2NUM(stats->send_queue_peak_bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("connects")), ULL2NUM(stats->connects));
+    rb_hash_aset(hash, ID2SYM(rb_intern("reconnects")),
+		 ULL2NUM(stats->connects ? stats->connects - 1 : 0));
+    rb_hash_aset(hash, ID2SYM(rb_intern("handler_time")), _hist_to_hash(&stats->handler_time));
+    rb_hash_aset(hash, ID2SYM(rb_intern("dispatch_latency")), _hist_to_hash(&stats->dispatch_latency));
+    return hash;
+}
+
+/*Counters of the connection: bytes, stanzas in and out by [name, type], send queue high-water mark,
+  connects, and handler time and read-to-dispatch latency summaries */
+static VALUE t_xmpp_conn_stats(VALUE self) {
+    return _stats_to_hash(&_get_conn_data(self)->stats);
+}
+
+/*The counters of all the connections of the context added up, see Connection#stats */
+static VALUE t_xmpp_ctx_stats(VALUE self) {
+    t_ctx_t *tctx = _get_ctx_data(self);
+    t_conn_t *tc;
+    stats_conn_t *total = ZALLOC(stats_conn_t);
+    int conns = 0;
+    VALUE hash;
+
+    for (tc = tctx->conns; tc; tc = tc->next) {
+	stats_merge(total, &tc->stats);
+	conns++;
+    }
+    hash = _stats_to_hash(total);
+    xfree(total);
+    rb_hash_aset(hash, ID2SYM(rb_intern("connections")), INT2NUM(conns));
+    return hash;
+}
+
+/* Prometheus text exposition of the context's connections */
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+} prom_counters[] = {
+    { "bytes_read_total", "counter", "Bytes read from the socket or fed.", offsetof(stats_conn_t, bytes_read) },
+    { "bytes_written_total", "counter", "Bytes of stanzas and raw data sent.", offsetof(stats_conn_t, bytes_written) },
+    { "connects_total", "counter", "Connection attempts.", offsetof(stats_conn_t, connects) },
+    { "send_queue_peak_bytes", "gauge", "Most bytes waiting in the send queue.", offsetof(stats_conn_t, send_queue_peak_bytes) },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} prom_summaries[] = {
+    { "handler_seconds", "Time spent in the handlers of a stanza.", offsetof(stats_conn_t, handler_time) },
+    { "dispatch_latency_seconds", "Time from reading a chunk to running its handlers.", offsetof(stats_conn_t, dispatch_latency) },
+};
+
+#define PROM_FIELD(stats, offset, type) ((const type *)((const char *)(stats) + (offset)))
+
+/* label value with \ " and newlines escaped */
+static void _prom_label(VALUE out, const char *name, const char *value) {
+    const char *p;
+
+    rb_str_catf(out, "%s=\"", name);
+    for (p = value ? value : ""; *p; p++) {
+	if (*p == '\\' || *p == '"')
+	    rb_str_cat(out, "\\", 1);
+	if (*p == '\n')
+	    rb_str_cat(out, "\\n", 2);
+	else
+	    rb_str_cat(out, p, 1);
+    }
+    rb_str_cat(out, "\"", 1);
+}
+
+static void _prom_conn_labels(VALUE out, int index, const t_conn_t *tc) {
+    rb_str_catf(out, "conn=\"%d\",", index);
+    _prom_label(out, "jid", xmpp_conn_get_jid(tc->conn));
+}
+
+/*The stats of every connection of the context in the Prometheus text format, each metric name
+  starting with prefix (strophe_ruby by default) and labelled with the connection's index and jid */
+static VALUE t_xmpp_ctx_prometheus(int argc, VALUE *argv, VALUE self) {
+    t_ctx_t *tctx = _get_ctx_data(self);
+    VALUE rb_prefix, out = rb_str_buf_new(4096);
+    const char *prefix;
+    t_conn_t *tc;
+    const stats_hist_t *hist;
+    const stats_kind_t *kind;
+    size_t m, q;
+    int i, index;
+
+    rb_scan_args(argc, argv, "01", &rb_prefix);
+    prefix = NIL_P(rb_prefix) ? "strophe_ruby" : STR2CSTR(rb_prefix);
+
+#define EACH_CONN for (tc = tctx->conns, index = 0; tc; tc = tc->next, index++)
+
+    for (m = 0; m < sizeof(prom_counters) / sizeof(prom_counters[0]); m++) {
+	rb_str_catf(out, "# HELP %s_%s %s\n# TYPE %s_%s %s\n", prefix, prom_counters[m].name,
+		    prom_counters[m].help, prefix, prom_counters[m].name, prom_counters[m].type);
+	EACH_CONN {
+	    rb_str_catf(out, "%s_%s{", prefix, prom_counters[m].name);
+	    _prom_conn_labels(out, index, tc);
+	    rb_str_catf(out, "} %llu\n",
+			(unsigned long long)*PROM_FIELD(&tc->stats, prom_counters[m].offset, uint64_t));
+	}
+    }
+
+    for (m = 0; m < 2; m++) {
+	const char *dir = m ? "out" : "in";
+	rb_str_catf(out, "# HELP %s_stanzas_%s_total Toplevel elements %s by name and type.\n"
+		    "# TYPE %s_stanzas_%s_total counter\n",
+		    prefix, dir, m ? "sent" : "received", prefix, dir);
+	EACH_CONN {
+	    for (i = 0; i < tc->stats.nkinds; i++) {
+		kind = &tc->stats.kinds[i];
+		rb_str_catf(out, "%s_stanzas_%s_total{", prefix, dir);
+		_prom_conn_labels(out, index, tc);
+		rb_str_cat(out, ",", 1);
+		_prom_label(out, "name", kind->name);
+		rb_str_cat(out, ",", 1);
+		_prom_label(out, "type", kind->type);
+		rb_str_catf(out, "} %llu\n", (unsigned long long)(m ? kind->out : kind->in));
+	    }
+	}
+    }
+
+    for (m = 0; m < sizeof(prom_summaries) / sizeof(prom_summaries[0]); m++) {
+	rb_str_catf(out, "# HELP %s_%s %s\n# TYPE %s_%s summary\n", prefix, prom_summaries[m].name,
+		    prom_summaries[m].help, prefix, prom_summaries[m].name);
+	EACH_CONN {
+	    hist = PROM_FIELD(&tc->stats, prom_summaries[m].offset, stats_hist_t);
+	    for (q = 0; q < STATS_QUANTILES; q++) {
+		rb_str_catf(out, "%s_%s{", prefix, prom_summaries[m].name);
+		_prom_conn_labels(out, index, tc);
+		rb_str_catf(out, ",quantile=\"%g\"} %.9f\n", stats_quantiles[q],
+			    stats_hist_percentile(hist, stats_quantiles[q]) / 1e9);
+	    }
+	    rb_str_catf(out, "%s_%s_sum{", prefix, prom_summaries[m].name);
+	    _prom_conn_labels(out, index, tc);
+	    rb_str_catf(out, "} %.9f\n", hist->sum / 1e9);
+	    rb_str_catf(out, "%s_%s_count{", prefix, prom_summaries[m].name);
+	    _prom_conn_labels(out, index, tc);
+	    rb_str_catf(out, "} %llu\n", (unsigned long long)hist->count);
+	}
+    }
+#undef EACH_CONN
+    return out;
+}
+
 /* Disconnect from the stream. Is it needed? Not too sure about it. Normally if you just call xmpp_stop you should be fine*/
 static VALUE t_xmpp_disconnect(VALUE self) {
     xmpp_conn_t *conn;
-    Data_Get_Struct(self, xmpp_conn_t, conn);
+    conn = _get_conn(self);
     xmpp_disconnect(conn);
     return Qtrue;
 }
 
-/* Send a stanza in the stream */
+/* record the send queue high-water mark, it only grows when we queue something. Returns
+   the bytes waiting, as metered around the sends: the queue items and their copies of the data */
+static uint64_t _send_queue_peak(t_conn_t *tc) {
+    uint64_t bytes = __atomic_load_n(&tc->send_queue.bytes, __ATOMIC_RELAXED);
+
+    stats_peak(&tc->stats.send_queue_peak_bytes, bytes);
+    return bytes;
+}
+
+/* count data handed to libstrophe to send, and record it. libstrophe's loop does the writing,
+   its own traffic (stream headers, authentication) isn't seen here */
+static void _conn_sent(t_conn_t *tc, const char *data, size_t len) {
+    stats_add(&tc->stats.bytes_written, len);
+    if (tc->capture)
+	capture_write(tc->capture, CAPTURE_OUT, data, len);
+}
+
+static long _stanza_render_len(xmpp_stanza_t *stanza);
+static char *_stanza_render(xmpp_stanza_t *stanza, char *dst);
+
+/* Send a stanza in the stream. Serialized by _stanza_render like Stanza#to_s, so the escape
+   kernel does the work, then queued as raw data */
 static VALUE t_xmpp_send(VALUE self, VALUE rb_stanza) {
 
-    xmpp_conn_t *conn;
+    t_conn_t *tc = _get_conn_data(self);
+    xmpp_conn_t *conn = tc->conn;
+    xmpp_ctx_t *ctx = tc->tctx->ctx;
     xmpp_stanza_t *stanza;
+    uint64_t queued;
+    char *buf, *end = NULL;
+    long len;
     
-    Data_Get_Struct(self, xmpp_conn_t, conn);
-    Data_Get_Struct(rb_stanza, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(rb_stanza);
+    if ((len = _stanza_render_len(stanza)) < 0)
+	rb_raise(rb_eArgError, "stanza cannot be serialized (missing name?)");
     
-    xmpp_send(conn,stanza);
+    mem_scope_t scope = _mem_scope(ctx, MEM_SEND_QUEUE);
+    if ((buf = xmpp_alloc(ctx, len + 1)) && (end = _stanza_render(stanza, buf))) {
+	*end = '\0';
+	mem_scope_meter(&tc->send_queue);
+	xmpp_send_raw(conn, buf, len);
+	mem_scope_meter(NULL);
+	_conn_sent(tc, buf, len);
+	if (async_log_wants(ctx, XMPP_LEVEL_DEBUG))
+	    xmpp_debug(ctx, "conn", "SENT: %s", buf);
+    }
+    if (buf)
+	xmpp_free(ctx, buf);
+    mem_scope_leave(scope);
+    if (!end)
+	rb_raise(rb_eNoMemError, "could not serialize the stanza");
+    stats_stanza(&tc->stats, xmpp_stanza_get_name(stanza), xmpp_stanza_get_type(stanza), 1);
+    queued = _send_queue_peak(tc);
+    PROBE_SEND(conn, xmpp_stanza_get_name(stanza), queued);
     return Qtrue;
 }
 
 /* send raw data thru stream */
 static VALUE t_xmpp_send_raw_string(VALUE self, VALUE str) {
-  xmpp_conn_t *conn;
-  Data_Get_Struct(self,xmpp_conn_t,conn);
-  xmpp_send_raw_string(conn, STR2CSTR(str));  
+  t_conn_t *tc = _get_conn_data(self);
+  xmpp_conn_t *conn = tc->conn;
+  char *data = STR2CSTR(str);
+  mem_scope_t scope = _mem_scope(tc->tctx->ctx, MEM_SEND_QUEUE);
+  mem_scope_meter(&tc->send_queue);
+  xmpp_send_raw_string(conn, "%s", data);
+  mem_scope_leave(scope);
+  _conn_sent(tc, data, strlen(data));
+  uint64_t queued = _send_queue_peak(tc);
+  PROBE_SEND(conn, "", queued);
+  return Qtrue;
 }
     
-/* Create a new stanza */
-VALUE t_xmpp_stanza_new(VALUE class) {
+/* Create a new stanza in ctx, by default the context of the last connection created */
+VALUE t_xmpp_stanza_new(int argc, VALUE *argv, VALUE class) {
   //Get the context in a format that C can understand
   xmpp_ctx_t *ctx;
-  VALUE rb_conn = rb_gv_get("rb_conn");
-  Data_Get_Struct(rb_iv_get(rb_conn,"@ctx"), xmpp_ctx_t, ctx);
+  VALUE rb_ctx;
+
+  rb_scan_args(argc, argv, "01", &rb_ctx);
+  ctx = NIL_P(rb_ctx) ? _default_ctx()->ctx : _get_ctx(rb_ctx);
   
+  mem_scope_t scope = _mem_scope(ctx, MEM_STANZA);
   xmpp_stanza_t *stanza = xmpp_stanza_new(ctx);
-  VALUE tdata = Data_Wrap_Struct(class, 0, t_xmpp_stanza_release, stanza);
+  mem_scope_leave(scope);
+  if (!stanza)
+    rb_raise(rb_eNoMemError, "could not create the stanza");
+  mem_stanzas_built(stanza);
+  VALUE tdata = _stanza_wrap(class, stanza);
+  return tdata;
 }
 
-/*Clone a stanza. TODO: Test this!*/
+/*Clone a stanza: another handle on the same stanza, for a copy use copy*/
 static VALUE t_xmpp_stanza_clone(VALUE self) {
-    xmpp_stanza_t *stanza;
-    xmpp_stanza_t *new_stanza;
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
-    new_stanza = xmpp_stanza_clone(stanza);
-    VALUE tdata = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, new_stanza);
-    return tdata;
+    return _stanza_wrap_node(_get_stanza(self));
 }
 
 /*Copy a stanza. TODO: Test this!*/
 static VALUE t_xmpp_stanza_copy(VALUE self) {
     xmpp_stanza_t *stanza;
     xmpp_stanza_t *new_stanza;
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
+    mem_scope_t scope = _mem_scope(stanza->ctx, MEM_STANZA);
     new_stanza = xmpp_stanza_copy(stanza);
-    VALUE tdata = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, new_stanza);
+    mem_scope_leave(scope);
+    if (!new_stanza)
+	rb_raise(rb_eNoMemError, "could not copy the stanza");
+    mem_stanzas_built(new_stanza);
+    VALUE tdata = _stanza_wrap(cStanza, new_stanza);
     return tdata;
 }
 
@@ -383,59 +1978,246 @@ message. If you have the top level stanza you can do something like : body_stanz
 static VALUE t_xmpp_stanza_get_children(VALUE self) {
     xmpp_stanza_t *stanza;
     xmpp_stanza_t *children;
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     children = xmpp_stanza_get_children(stanza);
-
-    if(children) {
-	VALUE tdata = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, children);
-        return tdata;
-    }
-    else
-	return Qnil;
+    return _stanza_wrap_node(children);
 }
 
 /*Get the child of a stanza by its name. eg. body_stanza = message_stanza.child_by_name("body")*/
 static VALUE t_xmpp_stanza_get_child_by_name(VALUE self, VALUE rb_name) {
     xmpp_stanza_t *stanza;
     xmpp_stanza_t *child;
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     
     char *name = STR2CSTR(rb_name);
     child = xmpp_stanza_get_child_by_name(stanza, name);
-        
-    if(child) {   
-	VALUE rb_child = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, child);
-        return rb_child;
-    } else {
-	return Qnil;
-    }
+    return _stanza_wrap_node(child);
+}
+
+/*Get the first child of a stanza with the given namespace. eg. x = presence.child_by_ns("jabber:x:data")*/
+static VALUE t_xmpp_stanza_get_child_by_ns(VALUE self, VALUE rb_ns) {
+    xmpp_stanza_t *child;
+    
+    child = xmpp_stanza_get_child_by_ns(_get_stanza(self), STR2CSTR(rb_ns));
+    return _stanza_wrap_node(child);
 }
 
-/*TODO: Test this!*/
+/*Get the next sibling of a stanza, nil after the last one */
 static VALUE t_xmpp_stanza_get_next(VALUE self) {
     xmpp_stanza_t *stanza;
     xmpp_stanza_t *next;
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     
     next = xmpp_stanza_get_next(stanza);
+    return _stanza_wrap_node(next);
+}
 
-    VALUE tdata = Data_Wrap_Struct(cStanza, 0, t_xmpp_stanza_release, next);
-    return tdata;
+/* filters for each_child, NULL fields match anything */
+typedef struct {
+    const char *name;
+    const char *ns;
+} child_filter_t;
+
+static void _child_filter_scan(int argc, VALUE *argv, child_filter_t *filter) {
+    VALUE opts, val;
+
+    filter->name = filter->ns = NULL;
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (NIL_P(opts))
+	return;
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("name")));
+    if (!NIL_P(val))
+	filter->name = StringValueCStr(val);
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("ns")));
+    if (!NIL_P(val))
+	filter->ns = StringValueCStr(val);
+}
+
+static int _child_filter_matches(child_filter_t *filter, xmpp_stanza_t *child) {
+    char *ns;
+
+    if (!xmpp_stanza_is_tag(child))
+	return 0;
+    if (filter->name && (!child->data || strcmp(filter->name, child->data) != 0))
+	return 0;
+    if (filter->ns) {
+	ns = xmpp_stanza_get_ns(child);
+	if (!ns || strcmp(filter->ns, ns) != 0)
+	    return 0;
+    }
+    return 1;
+}
+
+/*Yield the child elements of a stanza, optionally only those with a given name and/or namespace.
+  Filtering is done natively, only the yielded children get wrapped. eg. query.each_child(name: "item") { |item| ... } */
+static VALUE t_xmpp_stanza_each_child(int argc, VALUE *argv, VALUE self) {
+    child_filter_t filter;
+    xmpp_stanza_t *child;
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    _child_filter_scan(argc, argv, &filter);
+    for (child = _get_stanza(self)->children; child; child = child->next) {
+	if (_child_filter_matches(&filter, child))
+	    rb_yield(_stanza_wrap_node(child));
+    }
+    return self;
+}
+
+/* pre-order walk below stanza. A block returning :prune skips that element's descendants */
+static void _stanza_each_element(xmpp_stanza_t *stanza, VALUE prune) {
+    xmpp_stanza_t *child;
+
+    for (child = stanza->children; child; child = child->next) {
+	if (!xmpp_stanza_is_tag(child))
+	    continue;
+	if (rb_yield(_stanza_wrap_node(child)) != prune)
+	    _stanza_each_element(child, prune);
+    }
 }
 
-/*Get the attribute of a stanza. eg. message_stanza.child_by_name("body").text*/
+/*Depth-first walk over every element below the stanza. Return :prune from the block to skip
+  the children of the element just yielded */
+static VALUE t_xmpp_stanza_each_element(VALUE self) {
+    RETURN_ENUMERATOR(self, 0, 0);
+    _stanza_each_element(_get_stanza(self), ID2SYM(rb_intern("prune")));
+    return self;
+}
+
+/* value of one attribute as a Ruby string (or nil), going through the memo slots */
+static VALUE _stanza_attribute(t_stanza_t *ts, const char *attribute) {
+    VALUE *slot = _stanza_attribute_slot(ts, attribute);
+    char *val = xmpp_stanza_get_attribute(ts->stanza, attribute);
+
+    if (slot)
+	return _stanza_cached(slot, val);
+    return val ? rb_str_new2(val) : Qnil;
+}
+
+/*Get the attribute of a stanza. eg. message_stanza.attribute("from"). from, to, type and id are memoized */
 static VALUE t_xmpp_stanza_get_attribute(VALUE self, VALUE rb_attribute) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
-        
-    char *val = xmpp_stanza_get_attribute(stanza,STR2CSTR(rb_attribute));
-    return rb_str_new2(val);
+    return _stanza_attribute(_get_stanza_data(self), STR2CSTR(rb_attribute));
+}
+
+typedef struct {
+    xmpp_stanza_t *stanza;
+    hash_iterator_t *iter;
+    VALUE hash;
+} attributes_walk_t;
+
+static VALUE _stanza_attributes_walk(VALUE ptr) {
+    attributes_walk_t *walk = (attributes_walk_t *)ptr;
+    const char *key;
+
+    while ((key = hash_iter_next(walk->iter)))
+	rb_hash_aset(walk->hash, rb_obj_freeze(rb_str_new2(key)),
+		     rb_str_new2((char *)hash_get(walk->stanza->attributes, key)));
+    return walk->hash;
+}
+
+static VALUE _stanza_attributes_walk_done(VALUE ptr) {
+    hash_iter_release(((attributes_walk_t *)ptr)->iter);
+    return Qnil;
+}
+
+/* build a {name => value} Hash out of the attribute table in a single walk. The iterator
+   is released even if building a string raises */
+static VALUE _stanza_attributes_hash(xmpp_stanza_t *stanza) {
+    attributes_walk_t walk;
+
+    if (!stanza->attributes)
+	return rb_hash_new();
+
+    walk.stanza = stanza;
+    walk.hash = rb_hash_new_capa(hash_num_keys(stanza->attributes));
+    walk.iter = hash_iter_new(stanza->attributes);
+    if (!walk.iter)
+	rb_raise(rb_eNoMemError, "could not iterate stanza attributes");
+    return rb_ensure(_stanza_attributes_walk, (VALUE)&walk, _stanza_attributes_walk_done, (VALUE)&walk);
+}
+
+typedef struct {
+    xmpp_ctx_t *ctx;
+    char *text;
+} stanza_text_t;
+
+static VALUE _stanza_text_str(VALUE ptr) {
+    return rb_str_new2(((stanza_text_t *)ptr)->text);
+}
+
+static VALUE _stanza_text_free(VALUE ptr) {
+    stanza_text_t *t = (stanza_text_t *)ptr;
+    xmpp_free(t->ctx, t->text);
+    return Qnil;
+}
+
+/* the text of stanza's children as a Ruby string. libstrophe hands us a copy, ours to free */
+static VALUE _stanza_text(xmpp_stanza_t *stanza) {
+    stanza_text_t t = { stanza->ctx, xmpp_stanza_get_text(stanza) };
+
+    if (!t.text)
+	return rb_str_new2("");
+    return rb_ensure(_stanza_text_str, (VALUE)&t, _stanza_text_free, (VALUE)&t);
+}
+
+/* convert a stanza into {"name", "attributes", "text", "children"}, the same keys either way.
+   "text" is the text of its children. "children" is nil unless deep, then it holds the
+   converted children, text children as plain strings */
+static VALUE _stanza_to_h(xmpp_stanza_t *stanza, int deep) {
+    xmpp_stanza_t *child;
+    VALUE hash, children = Qnil;
+    long count = 0;
+
+    if (xmpp_stanza_is_text(stanza))
+	return rb_str_new2(stanza->data ? stanza->data : "");
+
+    hash = rb_hash_new_capa(4);
+    rb_hash_aset(hash, rb_str_new2("name"),
+		 stanza->data ? rb_str_new2(stanza->data) : Qnil);
+    rb_hash_aset(hash, rb_str_new2("attributes"), _stanza_attributes_hash(stanza));
+    rb_hash_aset(hash, rb_str_new2("text"), _stanza_text(stanza));
+
+    if (deep) {
+	for (child = stanza->children; child; child = child->next)
+	    count++;
+	children = rb_ary_new_capa(count);
+	for (child = stanza->children; child; child = child->next)
+	    rb_ary_push(children, _stanza_to_h(child, 1));
+    }
+    rb_hash_aset(hash, rb_str_new2("children"), children);
+    return hash;
+}
+
+/*All the attributes of a stanza as a Hash. eg. presence.attributes["from"] */
+static VALUE t_xmpp_stanza_get_attributes(VALUE self) {
+    return _stanza_attributes_hash(_get_stanza(self));
+}
+
+/*Get several attributes at once. eg. from, to = stanza.values_at("from", "to") */
+static VALUE t_xmpp_stanza_values_at(int argc, VALUE *argv, VALUE self) {
+    t_stanza_t *ts = _get_stanza_data(self);
+    VALUE values = rb_ary_new_capa(argc);
+    int i;
+
+    for (i = 0; i < argc; i++)
+	rb_ary_push(values, _stanza_attribute(ts, STR2CSTR(argv[i])));
+    return values;
+}
+
+/*Convert the stanza into a Hash with "name", "attributes", "text" and "children". "children" is nil
+  unless deep: true, which converts the whole subtree in the same pass */
+static VALUE t_xmpp_stanza_to_h(int argc, VALUE *argv, VALUE self) {
+    VALUE opts, deep = Qfalse;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+	deep = rb_hash_aref(opts, ID2SYM(rb_intern("deep")));
+    return _stanza_to_h(_get_stanza(self), RTEST(deep));
 }
 
 /*Get the namespace of a stanza TODO: Test this!*/
 static VALUE t_xmpp_stanza_get_ns(VALUE self) {
     xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     
     char *ns = xmpp_stanza_get_ns(stanza);
     return rb_str_new2(ns);
@@ -443,140 +2225,830 @@ static VALUE t_xmpp_stanza_get_ns(VALUE self) {
 
 /*Get the text of a stanza. */
 static VALUE t_xmpp_stanza_get_text(VALUE self) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
-    
-    char *text = xmpp_stanza_get_text(stanza);
-    
-    if(text)
-	return rb_str_new2(text);
-    else
-	return rb_str_new2("");
+    return _stanza_text(_get_stanza(self));
 }
 
 /*Get the name of a stanza (message, presence, iq) */
 static VALUE t_xmpp_stanza_get_name(VALUE self) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
-    char *name = xmpp_stanza_get_name(stanza);
-    return rb_str_new2(name);
+    return _stanza_cached(&ts->name, xmpp_stanza_get_name(ts->stanza));
 }
 
 /*Get the type of a stanza. For example, if the name is 'message', type can be 'chat', 'normal' and so on */
 static VALUE t_xmpp_stanza_get_type(VALUE self) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
-    
-    char *type = xmpp_stanza_get_type(stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
-    if(type)
-	return rb_str_new2(type);
-    else
-	return Qnil;
+    return _stanza_cached(&ts->type, xmpp_stanza_get_type(ts->stanza));
 }
 
 /*Get the id of a stanza. TODO:Test this!*/
 static VALUE t_xmpp_stanza_get_id(VALUE self) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
-    char *id = xmpp_stanza_get_id(stanza);
-    return rb_str_new2(id);
+    return _stanza_cached(&ts->id, xmpp_stanza_get_id(ts->stanza));
 }
 
 /*Set the value of a stanza attribute (eg. stanza.set_attribute("to","johnsmith@example.com") */
 static VALUE t_xmpp_stanza_set_attribute(VALUE self, VALUE rb_attribute, VALUE rb_val) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
     char *attribute = STR2CSTR(rb_attribute);
     char *val = STR2CSTR(rb_val);
+    VALUE *slot = _stanza_attribute_slot(ts, attribute);
     
-    xmpp_stanza_set_attribute(stanza, attribute, val);
+    mem_scope_t scope = _mem_scope(ts->stanza->ctx, MEM_HASH);
+    xmpp_stanza_set_attribute(ts->stanza, attribute, val);
+    mem_scope_leave(scope);
+    if (slot)
+	*slot = Qundef;
     return Qtrue;
 }
 
 /*Set the namespace of a stanza. TODO:Test this!*/
 static VALUE t_xmpp_stanza_set_ns(VALUE self, VALUE rb_ns) {
     xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     
     char *ns = STR2CSTR(rb_ns);
     
+    mem_scope_t scope = _mem_scope(stanza->ctx, MEM_HASH);
     xmpp_stanza_set_ns(stanza, ns);
+    mem_scope_leave(scope);
     return Qtrue;
 }
 
-static VALUE t_xmpp_stanza_to_text(VALUE self) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
-    
-    char* buffer;
+/* Serialization, in two passes: the first measures the exact output length, the second
+   writes the XML straight into a Ruby string of that size. No intermediate buffer, nothing
+   to free afterwards. Attribute values are quoted with " and, like text, have &, <, > and "
+   escaped. */
+
+/* escaping kernel picked for this CPU when the extension is loaded */
+static const xml_escape_kernel_t *escape_kernel;
+
+/* length of s once &, <, > and " are escaped */
+static size_t _xml_escaped_len(const char *s) {
+    return xml_escaped_len(escape_kernel, s, strlen(s));
+}
+
+static char *_xml_escape_into(char *dst, const char *s) {
+    return xml_escape_into(escape_kernel, dst, s, strlen(s));
+}
+
+/* number of bytes _stanza_render will write for stanza, -1 if it can't be rendered */
+static long _stanza_render_len(xmpp_stanza_t *stanza) {
+    hash_iterator_t *iter;
+    xmpp_stanza_t *child;
+    const char *key;
+    long len, child_len;
+
+    if (stanza->type == XMPP_STANZA_UNKNOWN)
+	return 0;
+    if (stanza->type == XMPP_STANZA_TEXT)
+	return stanza->data ? _xml_escaped_len(stanza->data) : 0;
+    if (!stanza->data)
+	return -1;
+
+    len = 1 + strlen(stanza->data); /* <name */
+    if (stanza->attributes) {
+	iter = hash_iter_new(stanza->attributes);
+	if (!iter)
+	    return -1;
+	while ((key = hash_iter_next(iter)))
+	    len += strlen(key) + 4 /* space, =, quotes */ +
+		_xml_escaped_len((char *)hash_get(stanza->attributes, key));
+	hash_iter_release(iter);
+    }
+
+    if (!stanza->children)
+	return len + 2; /* /> */
+
+    len += 1; /* > */
+    for (child = stanza->children; child; child = child->next) {
+	child_len = _stanza_render_len(child);
+	if (child_len < 0)
+	    return -1;
+	len += child_len;
+    }
+    return len + 3 + strlen(stanza->data); /* </name> */
+}
+
+/* write stanza to dst, which must have room for _stanza_render_len bytes. Returns the end,
+   NULL if the attributes couldn't be walked */
+static char *_stanza_render(xmpp_stanza_t *stanza, char *dst) {
+    hash_iterator_t *iter;
+    xmpp_stanza_t *child;
+    const char *key;
     size_t len;
-    xmpp_stanza_to_text(stanza, &buffer, &len);
-    if (NULL == buffer)
-      return rb_str_new(0, 0);
-    else
-      return rb_str_buf_new2(buffer);
+
+    if (stanza->type == XMPP_STANZA_UNKNOWN)
+	return dst;
+    if (stanza->type == XMPP_STANZA_TEXT)
+	return stanza->data ? _xml_escape_into(dst, stanza->data) : dst;
+
+    len = strlen(stanza->data);
+    *dst++ = '<';
+    memcpy(dst, stanza->data, len);
+    dst += len;
+    if (stanza->attributes) {
+	if (!(iter = hash_iter_new(stanza->attributes)))
+	    return NULL;
+	while ((key = hash_iter_next(iter))) {
+	    size_t key_len = strlen(key);
+	    *dst++ = ' ';
+	    memcpy(dst, key, key_len);
+	    dst += key_len;
+	    *dst++ = '=';
+	    *dst++ = '"';
+	    dst = _xml_escape_into(dst, (char *)hash_get(stanza->attributes, key));
+	    *dst++ = '"';
+	}
+	hash_iter_release(iter);
+    }
+
+    if (!stanza->children) {
+	*dst++ = '/';
+	*dst++ = '>';
+	return dst;
+    }
+
+    *dst++ = '>';
+    for (child = stanza->children; child; child = child->next) {
+	if (!(dst = _stanza_render(child, dst)))
+	    return NULL;
+    }
+    *dst++ = '<';
+    *dst++ = '/';
+    memcpy(dst, stanza->data, len);
+    dst += len;
+    *dst++ = '>';
+    return dst;
+}
+
+/* append the XML for stanza to str, growing it once to the exact size needed */
+static VALUE _stanza_append_xml(VALUE str, xmpp_stanza_t *stanza) {
+    long len = _stanza_render_len(stanza);
+    long old_len = RSTRING_LEN(str);
+    char *end;
+
+    if (len < 0)
+	rb_raise(rb_eArgError, "stanza cannot be serialized (missing name?)");
+    rb_str_modify_expand(str, len);
+    end = _stanza_render(stanza, RSTRING_PTR(str) + old_len);
+    if (!end)
+	rb_raise(rb_eNoMemError, "could not serialize the stanza");
+    rb_str_set_len(str, end - RSTRING_PTR(str));
+    return str;
+}
+
+/*Escape &, <, > and " in a string the way the serializer does. kernel: picks a specific
+  scan kernel (see XML.kernels), which is only useful to test and benchmark them */
+static VALUE t_xml_escape(int argc, VALUE *argv, VALUE self) {
+    const xml_escape_kernel_t *kernel = escape_kernel;
+    VALUE str, opts, result;
+    char *end;
+
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+    StringValue(str);
+    if (!NIL_P(opts)) {
+	VALUE name = rb_hash_aref(opts, ID2SYM(rb_intern("kernel")));
+	if (!NIL_P(name)) {
+	    kernel = xml_escape_kernel(rb_id2name(SYM2ID(rb_to_symbol(name))));
+	    if (!kernel)
+		rb_raise(rb_eArgError, "escape kernel not available on this CPU");
+	}
+    }
+
+    result = rb_str_new(0, xml_escaped_len(kernel, RSTRING_PTR(str), RSTRING_LEN(str)));
+    end = xml_escape_into(kernel, RSTRING_PTR(result), RSTRING_PTR(str), RSTRING_LEN(str));
+    rb_str_set_len(result, end - RSTRING_PTR(result));
+    rb_enc_copy(result, str);
+    return result;
+}
+
+/*Names of the escape kernels this CPU can run, fastest (the one in use) last */
+static VALUE t_xml_kernels(VALUE self) {
+    VALUE names = rb_ary_new();
+    int i;
+
+    for (i = 0; i < xml_escape_kernel_count(); i++)
+	rb_ary_push(names, ID2SYM(rb_intern(xml_escape_kernel_at(i)->name)));
+    return names;
+}
+
+/*Serialize the stanza into XML */
+static VALUE t_xmpp_stanza_to_text(VALUE self) {
+    return _stanza_append_xml(rb_utf8_str_new(0, 0), _get_stanza(self));
+}
+
+/*Append the XML of the stanza to an existing String, eg. stanza.write_to(log_buffer). Returns the buffer */
+static VALUE t_xmpp_stanza_write_to(VALUE self, VALUE buf) {
+    StringValue(buf);
+    return _stanza_append_xml(buf, _get_stanza(self));
 }
 
 /*Set the text of a stanza */
 static VALUE t_xmpp_stanza_set_text(VALUE self, VALUE rb_text) {
     xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
     
     char *text = STR2CSTR(rb_text);
     
+    mem_scope_t scope = _mem_scope(stanza->ctx, MEM_STANZA);
     xmpp_stanza_set_text(stanza, text);
+    mem_scope_leave(scope);
     return rb_text;    
 }
 
 /*Set the name of a stanza (message, presence, iq) */
 static VALUE t_xmpp_stanza_set_name(VALUE self, VALUE rb_name) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
     char *name = STR2CSTR(rb_name);
     
-    xmpp_stanza_set_name(stanza, name);
+    mem_scope_t scope = _mem_scope(ts->stanza->ctx, MEM_STANZA);
+    xmpp_stanza_set_name(ts->stanza, name);
+    mem_scope_leave(scope);
+    ts->name = Qundef;
     return Qtrue;
 }
 
 /*Set the type of a stanza. For example if the name is 'message', the type can be 'chat', 'normal' and so on*/
 static VALUE t_xmpp_stanza_set_type(VALUE self, VALUE rb_type) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
     char *type = STR2CSTR(rb_type);
     
-    xmpp_stanza_set_type(stanza, type);
+    mem_scope_t scope = _mem_scope(ts->stanza->ctx, MEM_HASH);
+    xmpp_stanza_set_type(ts->stanza, type);
+    mem_scope_leave(scope);
+    ts->type = Qundef;
     return Qtrue;
 }
 
 /*Set the id of a stanza. TODO:Test this!*/
 static VALUE t_xmpp_stanza_set_id(VALUE self, VALUE rb_id) {
-    xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    t_stanza_t *ts = _get_stanza_data(self);
     
     char *id = STR2CSTR(rb_id);
     
-    xmpp_stanza_set_id(stanza, id);
+    mem_scope_t scope = _mem_scope(ts->stanza->ctx, MEM_HASH);
+    xmpp_stanza_set_id(ts->stanza, id);
+    mem_scope_leave(scope);
+    ts->id = Qundef;
     return Qtrue;
 }
 
 /*Add a child element to a stanza (hint: message stanzas have a body element...)  */
 static VALUE t_xmpp_stanza_add_child(VALUE self, VALUE rb_child) {
     xmpp_stanza_t *stanza;    
-    Data_Get_Struct(self, xmpp_stanza_t, stanza);
+    stanza = _get_stanza(self);
 
-    xmpp_stanza_t *child;    
-    Data_Get_Struct(rb_child, xmpp_stanza_t, child);
+    t_stanza_t *tchild = _get_stanza_data(rb_child);
+    xmpp_stanza_t *child = tchild->stanza;
+    xmpp_stanza_t *root;
     int res = xmpp_stanza_add_child(stanza,child);
+
+    /* the child's wrapper now pins the tree it joined, so its parent outlives the parent's wrapper */
+    for (root = stanza; root->parent; root = root->parent);
+    if (res == XMPP_EOK && tchild->root != root && tchild->root->ctx == root->ctx) {
+	xmpp_stanza_clone(root);
+	_stanza_release_root(tchild->root);
+	tchild->root = root;
+    }
     return INT2FIX(res);
 }
 
 
+/* Path queries. A path such as "x[@xmlns='jabber:x:data']/item/@jid" is compiled once into
+   a list of steps, then evaluated natively against a stanza: intermediate nodes are never
+   wrapped, only the results handed back to ruby are. Steps match child elements by name
+   (or * for any), optionally filtered by [@attr] / [@attr='value'] predicates ([@xmlns=...]
+   matches the namespace). The last step may be @attr or text() to return strings. */
+
+typedef enum {
+    PATH_RESULT_STANZA,
+    PATH_RESULT_ATTRIBUTE,
+    PATH_RESULT_TEXT
+} path_result_t;
+
+typedef struct {
+    char *attr;
+    char *value; /* NULL when the predicate only checks for presence */
+} path_pred_t;
+
+typedef struct {
+    char *name; /* NULL matches any element */
+    int npreds;
+    path_pred_t *preds;
+} path_step_t;
+
+typedef struct {
+    int nsteps;
+    path_step_t *steps;
+    path_result_t result;
+    char *attribute;
+    VALUE source;
+} t_path_t;
+
+VALUE cPath;
+static VALUE path_cache;
+
+/* compiled paths kept around for Stanza#at / #query called with a String */
+#define PATH_CACHE_MAX 256
+
+static void t_path_mark(void *ptr) {
+    t_path_t *path = ptr;
+    rb_gc_mark(path->source);
+}
+
+static void t_path_free(void *ptr) {
+    t_path_t *path = ptr;
+    int i, j;
+
+    for (i = 0; i < path->nsteps; i++) {
+	for (j = 0; j < path->steps[i].npreds; j++) {
+	    xfree(path->steps[i].preds[j].attr);
+	    xfree(path->steps[i].preds[j].value);
+	}
+	xfree(path->steps[i].preds);
+	xfree(path->steps[i].name);
+    }
+    xfree(path->steps);
+    xfree(path->attribute);
+    xfree(path);
+}
+
+static size_t t_path_size(const void *ptr) {
+    const t_path_t *path = ptr;
+    return sizeof(t_path_t) + path->nsteps * sizeof(path_step_t);
+}
+
+static const rb_data_type_t t_path_type = {
+    "StropheRuby::Path",
+    { t_path_mark, t_path_free, t_path_size, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static char *_path_strndup(const char *s, long len) {
+    char *copy = ALLOC_N(char, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static void _path_syntax_error(VALUE source, const char *p, const char *what) {
+    rb_raise(rb_eArgError, "invalid path %s: %s at offset %ld",
+	     StringValueCStr(source), what, (long)(p - RSTRING_PTR(source)));
+}
+
+/* length of an XML name starting at p */
+static long _path_name_len(const char *p) {
+    const char *start = p;
+    while (*p && *p != '/' && *p != '[' && *p != ']' && *p != '=' && *p != '@' &&
+	   *p != '\'' && *p != '"' && *p != ' ')
+	p++;
+    return p - start;
+}
+
+/* parse one [@attr] or [@attr='value'] predicate, p points at '[' */
+static const char *_path_parse_pred(t_path_t *path, path_step_t *step, const char *p) {
+    path_pred_t *pred;
+    long len;
+
+    p++;
+    if (*p != '@')
+	_path_syntax_error(path->source, p, "expected @attribute in predicate");
+    p++;
+    len = _path_name_len(p);
+    if (len == 0)
+	_path_syntax_error(path->source, p, "empty attribute name");
+
+    REALLOC_N(step->preds, path_pred_t, step->npreds + 1);
+    pred = &step->preds[step->npreds++];
+    pred->attr = _path_strndup(p, len);
+    pred->value = NULL;
+    p += len;
+
+    if (*p == '=') {
+	char quote;
+	const char *end;
+
+	p++;
+	quote = *p;
+	if (quote != '\'' && quote != '"')
+	    _path_syntax_error(path->source, p, "expected quoted value");
+	end = strchr(p + 1, quote);
+	if (!end)
+	    _path_syntax_error(path->source, p, "unterminated value");
+	pred->value = _path_strndup(p + 1, end - p - 1);
+	p = end + 1;
+    }
+    if (*p != ']')
+	_path_syntax_error(path->source, p, "expected ]");
+    return p + 1;
+}
+
+static void _path_compile(t_path_t *path) {
+    const char *p = RSTRING_PTR(path->source);
+
+    if (*p == '/')
+	p++;
+    while (*p) {
+	path_step_t *step;
+	long len;
+
+	if (*p == '@') {
+	    len = _path_name_len(p + 1);
+	    if (len == 0 || p[len + 1] != '\0')
+		_path_syntax_error(path->source, p, "@attribute must be the last step");
+	    path->attribute = _path_strndup(p + 1, len);
+	    path->result = PATH_RESULT_ATTRIBUTE;
+	    break;
+	}
+	if (strcmp(p, "text()") == 0) {
+	    path->result = PATH_RESULT_TEXT;
+	    break;
+	}
+
+	REALLOC_N(path->steps, path_step_t, path->nsteps + 1);
+	step = &path->steps[path->nsteps++];
+	step->name = NULL;
+	step->npreds = 0;
+	step->preds = NULL;
+
+	if (*p == '*') {
+	    p++;
+	} else {
+	    len = _path_name_len(p);
+	    if (len == 0)
+		_path_syntax_error(path->source, p, "expected element name");
+	    step->name = _path_strndup(p, len);
+	    p += len;
+	}
+	while (*p == '[')
+	    p = _path_parse_pred(path, step, p);
+
+	if (*p == '/')
+	    p++;
+	else if (*p)
+	    _path_syntax_error(path->source, p, "unexpected character");
+    }
+    if (path->nsteps == 0 && path->result == PATH_RESULT_STANZA)
+	_path_syntax_error(path->source, p, "empty path");
+}
+
+/*Compile a path once to evaluate it against many stanzas. eg. ITEMS = StropheRuby::Path.compile("query/item/@jid") */
+static VALUE t_path_compile(VALUE klass, VALUE rb_source) {
+    t_path_t *path;
+    VALUE obj = TypedData_Make_Struct(klass, t_path_t, &t_path_type, path);
+
+    path->source = rb_str_new_frozen(StringValue(rb_source));
+    path->result = PATH_RESULT_STANZA;
+    _path_compile(path);
+    return obj;
+}
+
+static t_path_t *_get_path(VALUE obj) {
+    t_path_t *path;
+    TypedData_Get_Struct(obj, t_path_t, &t_path_type, path);
+    return path;
+}
+
+/* accept either a compiled Path or a String, compiling (and caching) the latter */
+static t_path_t *_path_for(VALUE rb_path) {
+    VALUE compiled;
+
+    if (rb_typeddata_is_kind_of(rb_path, &t_path_type))
+	return _get_path(rb_path);
+
+    compiled = rb_hash_aref(path_cache, rb_path);
+    if (NIL_P(compiled)) {
+	compiled = t_path_compile(cPath, rb_path);
+	if (RHASH_SIZE(path_cache) >= PATH_CACHE_MAX)
+	    rb_hash_clear(path_cache);
+	rb_hash_aset(path_cache, rb_str_new_frozen(rb_path), compiled);
+    }
+    return _get_path(compiled);
+}
+
+static int _path_step_matches(path_step_t *step, xmpp_stanza_t *stanza) {
+    int i;
+
+    if (!xmpp_stanza_is_tag(stanza))
+	return 0;
+    if (step->name && (!stanza->data || strcmp(step->name, stanza->data) != 0))
+	return 0;
+    for (i = 0; i < step->npreds; i++) {
+	char *val = xmpp_stanza_get_attribute(stanza, step->preds[i].attr);
+	if (!val)
+	    return 0;
+	if (step->preds[i].value && strcmp(step->preds[i].value, val) != 0)
+	    return 0;
+    }
+    return 1;
+}
+
+/* convert a matched stanza into the value the path asks for, Qundef if it has none */
+static VALUE _path_result(t_path_t *path, xmpp_stanza_t *stanza) {
+    char *val;
+
+    switch (path->result) {
+    case PATH_RESULT_ATTRIBUTE:
+	val = xmpp_stanza_get_attribute(stanza, path->attribute);
+	return val ? rb_str_new2(val) : Qundef;
+    case PATH_RESULT_TEXT:
+	return _stanza_text(stanza);
+    default:
+	return _stanza_wrap_node(stanza);
+    }
+}
+
+/* walk the children of stanza for step n. Pushes results into results, or stops at the
+   first one when results is Qnil. Returns the first result, Qundef if nothing matched */
+static VALUE _path_eval(t_path_t *path, xmpp_stanza_t *stanza, int n, VALUE results) {
+    xmpp_stanza_t *child;
+    VALUE found;
+
+    if (n == path->nsteps) {
+	found = _path_result(path, stanza);
+	if (found != Qundef && !NIL_P(results))
+	    rb_ary_push(results, found);
+	return found;
+    }
+    for (child = stanza->children; child; child = child->next) {
+	if (!_path_step_matches(&path->steps[n], child))
+	    continue;
+	found = _path_eval(path, child, n + 1, results);
+	if (found != Qundef && NIL_P(results))
+	    return found;
+    }
+    return Qundef;
+}
+
+/*The first match of the path below stanza (a Stanza, or a String for @attr and text() paths), nil if none */
+static VALUE t_path_first(VALUE self, VALUE rb_stanza) {
+    VALUE found = _path_eval(_get_path(self), _get_stanza(rb_stanza), 0, Qnil);
+    return found == Qundef ? Qnil : found;
+}
+
+/*Every match of the path below stanza, in document order */
+static VALUE t_path_all(VALUE self, VALUE rb_stanza) {
+    VALUE results = rb_ary_new();
+    _path_eval(_get_path(self), _get_stanza(rb_stanza), 0, results);
+    return results;
+}
+
+static VALUE t_path_source(VALUE self) {
+    return _get_path(self)->source;
+}
+
+/*First match of a path. eg. message.at("body/text()") or iq.at(ITEMS) with a compiled Path */
+static VALUE t_xmpp_stanza_at(VALUE self, VALUE rb_path) {
+    VALUE found = _path_eval(_path_for(rb_path), _get_stanza(self), 0, Qnil);
+    return found == Qundef ? Qnil : found;
+}
+
+/*All matches of a path. eg. iq.query("query[@xmlns='jabber:iq:roster']/item") */
+static VALUE t_xmpp_stanza_query(VALUE self, VALUE rb_path) {
+    VALUE results = rb_ary_new();
+    _path_eval(_path_for(rb_path), _get_stanza(self), 0, results);
+    return results;
+}
+
+/* StreamParser: the connections' parser (xml_parser.c) without a connection, always
+   offline. Stanzas completed by a chunk are queued in C and only wrapped and
+   yielded once expat returns, so a raising block can't unwind through the parser and a
+   large chunk can be parsed without holding the GVL */
+
+/* chunks at least this big are parsed with the GVL released */
+#define PARSE_NOGVL_THRESHOLD (64 * 1024)
+
+typedef struct {
+    xml_parser_t parser;
+    t_ctx_t *tctx;  /* NULL until initialized */
+    int stream;  /* the input starts with a stream header of its own */
+    int busy;
+
+    /* stanzas completed by the chunk being parsed */
+    xmpp_stanza_t **pending;
+    long npending;
+    long cap;
+} t_stream_parser_t;
+
+typedef struct {
+    t_stream_parser_t *sp;
+    const char *buf;
+    long len;
+    int ret;
+} stream_feed_t;
+
+VALUE cStreamParser;
+static VALUE parse_parser;
+
+
+static void _stream_parser_discard(t_stream_parser_t *sp) {
+    while (sp->npending > 0)
+	mem_stanza_release(sp->pending[--sp->npending]);
+}
+
+static void t_stream_parser_free(void *ptr) {
+    t_stream_parser_t *sp = ptr;
+
+    if (sp->tctx) {
+	_stream_parser_discard(sp);
+	if (sp->pending)
+	    xmpp_free(sp->tctx->ctx, sp->pending);
+	xml_parser_release(&sp->parser);
+	xml_parser_free(&sp->parser);
+	_ctx_unref(sp->tctx);
+    }
+    xfree(sp);
+}
+
+static size_t t_stream_parser_size(const void *ptr) {
+    const t_stream_parser_t *sp = ptr;
+    return sizeof(t_stream_parser_t) + sp->parser.text_cap + sp->cap * sizeof(xmpp_stanza_t *);
+}
+
+static const rb_data_type_t t_stream_parser_type = {
+    "StropheRuby::StreamParser",
+    { 0, t_stream_parser_free, t_stream_parser_size, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static t_stream_parser_t *_get_stream_parser(VALUE obj) {
+    t_stream_parser_t *sp;
+    TypedData_Get_Struct(obj, t_stream_parser_t, &t_stream_parser_type, sp);
+    if (!sp->tctx)
+	rb_raise(rb_eArgError, "uninitialized StreamParser");
+    return sp;
+}
+
+/* queue a complete toplevel stanza, may run without the GVL */
+static void _stream_parser_deliver(xml_parser_t * const parser, xmpp_stanza_t * const stanza) {
+    t_stream_parser_t *sp = (t_stream_parser_t *)parser->userdata;
+    xmpp_stanza_t **pending;
+    long cap;
+
+    if (sp->npending == sp->cap) {
+	cap = sp->cap ? sp->cap * 2 : 16;
+	pending = xmpp_realloc(parser->ctx, sp->pending, cap * sizeof(*pending));
+	if (!pending) {
+	    xmpp_error(parser->ctx, "xmpp", "dropped parsed %s stanza, out of memory",
+		       xmpp_stanza_get_name(stanza));
+	    mem_stanza_release(stanza);
+	    return;
+	}
+	sp->pending = pending;
+	sp->cap = cap;
+    }
+    sp->pending[sp->npending++] = stanza;
+}
+
+/* start a new document. Without a stream header of its own the input is wrapped in one */
+static int _stream_parser_begin(t_stream_parser_t *sp) {
+    static const char header[] = "<stream>";
+
+    _stream_parser_discard(sp);
+    if (!xml_parser_reset(&sp->parser))
+	return 0;
+    if (!sp->stream)
+	return xml_parser_feed(&sp->parser, header, sizeof(header) - 1);
+    return 1;
+}
+
+static void *_stream_parser_feed_nogvl(void *ptr) {
+    stream_feed_t *feed = ptr;
+    feed->ret = xml_parser_feed(&feed->sp->parser, feed->buf, feed->len);
+    return NULL;
+}
+
+/* parse a chunk and hand back the stanzas it completed as an Array. Parse errors
+   raise, after the stanzas completed before the error were delivered */
+static VALUE _stream_parser_feed(t_stream_parser_t *sp, VALUE data, int yield) {
+    stream_feed_t feed;
+    VALUE stanzas;
+    long i;
+
+    /* a frozen string can't change under us while the GVL is released */
+    data = rb_str_new_frozen(StringValue(data));
+    if (sp->busy)
+	rb_raise(rb_eRuntimeError, "StreamParser is already parsing in another thread");
+
+    feed.sp = sp;
+    feed.buf = RSTRING_PTR(data);
+    feed.len = RSTRING_LEN(data);
+    sp->busy = 1;
+    if (feed.len >= PARSE_NOGVL_THRESHOLD) {
+	rb_thread_call_without_gvl(_stream_parser_feed_nogvl, &feed, NULL, NULL);
+    } else {
+	_stream_parser_feed_nogvl(&feed);
+    }
+    sp->busy = 0;
+    RB_GC_GUARD(data);
+
+    /* the wrappers take over the references */
+    stanzas = rb_ary_new_capa(sp->npending);
+    for (i = 0; i < sp->npending; i++)
+	rb_ary_push(stanzas, _stanza_wrap(cStanza, sp->pending[i]));
+    sp->npending = 0;
+
+    if (yield) {
+	for (i = 0; i < RARRAY_LEN(stanzas); i++)
+	    rb_yield(RARRAY_AREF(stanzas, i));
+    }
+    if (!feed.ret)
+	rb_raise(rb_eArgError, "XML parse error: %s",
+		 XML_ErrorString(XML_GetErrorCode(sp->parser.expat)));
+    return stanzas;
+}
+
+static VALUE t_stream_parser_alloc(VALUE klass) {
+    t_stream_parser_t *sp;
+    VALUE obj = TypedData_Make_Struct(klass, t_stream_parser_t, &t_stream_parser_type, sp);
+    return obj;
+}
+
+static void _stream_parser_setup(t_stream_parser_t *sp, VALUE rb_ctx, int stream) {
+    t_ctx_t *tctx;
+
+    if (sp->tctx)
+	rb_raise(rb_eArgError, "StreamParser already initialized");
+    if (NIL_P(rb_ctx)) {
+	tctx = _offline_ctx();
+    } else {
+	tctx = _get_ctx_data(rb_ctx);
+    }
+    sp->tctx = _ctx_ref(tctx);
+    sp->stream = stream;
+    xml_parser_init(&sp->parser, tctx->ctx, &tctx->parsers);
+    sp->parser.deliver = _stream_parser_deliver;
+    sp->parser.userdata = sp;
+    if (!_stream_parser_begin(sp))
+	rb_raise(rb_eNoMemError, "failed to allocate a parser");
+}
+
+/*Parser for XML that doesn't come from a connection, eg. archived traffic.
+  StropheRuby::StreamParser.new(ctx = nil, :stream => true). With :stream => false the input
+  is a plain sequence of stanzas rather than a stream with its own <stream:stream> header */
+static VALUE t_stream_parser_init(int argc, VALUE *argv, VALUE self) {
+    t_stream_parser_t *sp;
+    VALUE rb_ctx, opts, stream;
+
+    TypedData_Get_Struct(self, t_stream_parser_t, &t_stream_parser_type, sp);
+    rb_scan_args(argc, argv, "01:", &rb_ctx, &opts);
+    stream = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("stream")));
+    _stream_parser_setup(sp, rb_ctx, NIL_P(stream) || RTEST(stream));
+    return self;
+}
+
+/*Parse the next chunk of the input, yielding every stanza it completes. Without a block the
+  stanzas are returned as an Array. Chunks may split the XML anywhere */
+static VALUE t_stream_parser_feed(VALUE self, VALUE data) {
+    VALUE stanzas = _stream_parser_feed(_get_stream_parser(self), data, rb_block_given_p());
+    return rb_block_given_p() ? self : stanzas;
+}
+
+/*Forget any partial input and start a new stream */
+static VALUE t_stream_parser_reset(VALUE self) {
+    t_stream_parser_t *sp = _get_stream_parser(self);
+
+    if (sp->busy)
+	rb_raise(rb_eRuntimeError, "StreamParser is already parsing in another thread");
+    if (!_stream_parser_begin(sp))
+	rb_raise(rb_eNoMemError, "failed to allocate a parser");
+    return self;
+}
+
+/*Build a stanza from its XML. eg. StropheRuby::Stanza.parse("<message to='a@b'><body>hi</body></message>") */
+static VALUE t_xmpp_stanza_parse(int argc, VALUE *argv, VALUE klass) {
+    VALUE xml, rb_ctx, parser, stanzas;
+    t_stream_parser_t *sp;
+
+    rb_scan_args(argc, argv, "11", &xml, &rb_ctx);
+
+    /* one parser is kept for reuse, others are made for another context or thread */
+    parser = parse_parser;
+    if (!NIL_P(rb_ctx) || NIL_P(parser) || _get_stream_parser(parser)->busy) {
+	parser = t_stream_parser_alloc(cStreamParser);
+	TypedData_Get_Struct(parser, t_stream_parser_t, &t_stream_parser_type, sp);
+	_stream_parser_setup(sp, rb_ctx, 0);
+	if (NIL_P(rb_ctx) && NIL_P(parse_parser))
+	    parse_parser = parser;
+    }
+    sp = _get_stream_parser(parser);
+    if (sp->parser.depth != 1 || XML_GetErrorCode(sp->parser.expat) != XML_ERROR_NONE)
+	_stream_parser_begin(sp);
+
+    stanzas = _stream_parser_feed(sp, xml, 0);
+    if (sp->parser.depth != 1)
+	rb_raise(rb_eArgError, "incomplete stanza");
+    if (RARRAY_LEN(stanzas) != 1)
+	rb_raise(rb_eArgError, "expected exactly one stanza, got %ld", RARRAY_LEN(stanzas));
+    return RARRAY_AREF(stanzas, 0);
+}
+
 void Init_strophe_ruby() {
     /*Main module that contains everything*/
     mStropheRuby = rb_define_module("StropheRuby");      
@@ -635,47 +3107,85 @@ void Init_strophe_ruby() {
     
     /*Context*/
     cContext = rb_define_class_under(mStropheRuby, "Context", rb_cObject);
-    rb_define_singleton_method(cContext, "new", t_xmpp_ctx_new, 1);
+    rb_define_singleton_method(cContext, "new", t_xmpp_ctx_new, -1);
     rb_define_method(cContext, "initialize", t_xmpp_ctx_init, 1);    
     rb_define_method(cContext, "free", t_xmpp_ctx_free, 0);
     rb_define_method(cContext, "loop_status", t_xmpp_get_loop_status, 0);
     rb_define_method(cContext, "loop_status=", t_xmpp_set_loop_status, 1);
+    rb_define_method(cContext, "parser_pool_stats", t_xmpp_ctx_parser_pool_stats, 0);
+    rb_define_method(cContext, "memory_stats", t_xmpp_ctx_memory_stats, 0);
+    rb_define_method(cContext, "flush_log", t_xmpp_ctx_flush_log, -1);
+    rb_define_method(cContext, "log_stats", t_xmpp_ctx_log_stats, 0);
+    rb_define_method(cContext, "stats", t_xmpp_ctx_stats, 0);
+    rb_define_method(cContext, "prometheus", t_xmpp_ctx_prometheus, -1);
     
     /*Connection*/
     cConnection = rb_define_class_under(mStropheRuby, "Connection", rb_cObject);
     rb_define_singleton_method(cConnection, "new", t_xmpp_conn_new, 1);
     rb_define_method(cConnection, "initialize", t_xmpp_conn_init, 1);
-    rb_define_method(cConnection, "clone", t_xmpp_conn_clone, 1);
+    rb_define_method(cConnection, "clone", t_xmpp_conn_clone, 0);
     rb_define_method(cConnection, "release", t_xmpp_conn_release, 0);
     rb_define_method(cConnection, "jid", t_xmpp_conn_get_jid,0);
     rb_define_method(cConnection, "jid=", t_xmpp_conn_set_jid,1);
     rb_define_method(cConnection, "password", t_xmpp_conn_get_pass,0);
     rb_define_method(cConnection, "password=", t_xmpp_conn_set_pass,1);
-    rb_define_method(cConnection, "connect", t_xmpp_connect_client,0);
+    rb_define_method(cConnection, "connect", t_xmpp_connect_client, -1);
     rb_define_method(cConnection, "disconnect", t_xmpp_disconnect, 0);
     rb_define_method(cConnection, "send", t_xmpp_send, 1);
     rb_define_method(cConnection, "send_raw_string", t_xmpp_send_raw_string, 1);
+    rb_define_method(cConnection, "feed", t_xmpp_conn_feed, 1);
+    rb_define_method(cConnection, "start_capture", t_xmpp_conn_start_capture, 1);
+    rb_define_method(cConnection, "stop_capture", t_xmpp_conn_stop_capture, 0);
+    rb_define_method(cConnection, "replay", t_xmpp_conn_replay, -1);
+    rb_define_method(cConnection, "limits", t_xmpp_conn_get_limits, 0);
+    rb_define_method(cConnection, "limits=", t_xmpp_conn_set_limits, 1);
+    rb_define_method(cConnection, "limit_hits", t_xmpp_conn_get_limit_hits, 0);
+    rb_define_method(cConnection, "stats", t_xmpp_conn_stats, 0);
+    rb_define_method(cConnection, "handler_stats", t_xmpp_conn_handler_stats, 0);
+    rb_define_method(cConnection, "slow_handler_threshold", t_xmpp_conn_get_slow_threshold, 0);
+    rb_define_method(cConnection, "slow_handler_threshold=", t_xmpp_conn_set_slow_threshold, 1);
+    rb_define_method(cConnection, "on_slow_handler", t_xmpp_conn_on_slow_handler, 0);
+
+    /*Blocks registered on a connection*/
+    cHandler = rb_define_class_under(mStropheRuby, "Handler", rb_cObject);
+    rb_undef_alloc_func(cHandler);
+    rb_define_method(cHandler, "kind", t_handler_kind, 0);
+    rb_define_method(cHandler, "source", t_handler_source, 0);
+    rb_define_method(cHandler, "stats", t_handler_stats, 0);
+    rb_define_method(cHandler, "remove", t_handler_remove, 0);
+    rb_define_method(cHandler, "removed?", t_handler_removed, 0);
+    id_call = rb_intern("call");
 
     /*Handlers*/
-    rb_define_method(cConnection, "add_handler", t_xmpp_handler_add, 1);
-    rb_define_method(cConnection, "add_id_handler", t_xmpp_id_handler_add, 3);
+    rb_define_method(cConnection, "add_handler", t_xmpp_handler_add, -1);
+    rb_define_method(cConnection, "add_id_handler", t_xmpp_id_handler_add, -1);
+
+    /*Raw stanzas handed to add_handler(name, raw: true) blocks*/
+    cRawStanza = rb_struct_define_under(mStropheRuby, "RawStanza", "xml", "name", "type", "from", NULL);
 
     /*Stanza*/
     cStanza = rb_define_class_under(mStropheRuby, "Stanza", rb_cObject);
-    rb_define_singleton_method(cStanza, "new", t_xmpp_stanza_new, 0);
+    rb_define_singleton_method(cStanza, "new", t_xmpp_stanza_new, -1);
     rb_define_method(cStanza, "clone", t_xmpp_stanza_clone, 0);
     rb_define_method(cStanza, "copy", t_xmpp_stanza_copy, 0);
     //rb_define_method(cStanza, "release", t_xmpp_stanza_release, 0);
     rb_define_method(cStanza, "children", t_xmpp_stanza_get_children, 0);
     rb_define_method(cStanza, "child_by_name", t_xmpp_stanza_get_child_by_name, 1);
+    rb_define_method(cStanza, "child_by_ns", t_xmpp_stanza_get_child_by_ns, 1);
     rb_define_method(cStanza, "next", t_xmpp_stanza_get_next, 0);
+    rb_define_method(cStanza, "each_child", t_xmpp_stanza_each_child, -1);
+    rb_define_method(cStanza, "each_element", t_xmpp_stanza_each_element, 0);
     rb_define_method(cStanza, "attribute", t_xmpp_stanza_get_attribute, 1);
+    rb_define_method(cStanza, "attributes", t_xmpp_stanza_get_attributes, 0);
+    rb_define_method(cStanza, "values_at", t_xmpp_stanza_values_at, -1);
+    rb_define_method(cStanza, "to_h", t_xmpp_stanza_to_h, -1);
     rb_define_method(cStanza, "ns", t_xmpp_stanza_get_ns, 0);
     rb_define_method(cStanza, "text", t_xmpp_stanza_get_text, 0);
     rb_define_method(cStanza, "name", t_xmpp_stanza_get_name, 0);
     rb_define_method(cStanza, "add_child", t_xmpp_stanza_add_child, 1);
     rb_define_method(cStanza, "ns=", t_xmpp_stanza_set_ns, 1);
     rb_define_method(cStanza, "to_s", t_xmpp_stanza_to_text, 0);
+    rb_define_method(cStanza, "write_to", t_xmpp_stanza_write_to, 1);
     rb_define_method(cStanza, "set_attribute", t_xmpp_stanza_set_attribute, 2);    
     rb_define_method(cStanza, "name=", t_xmpp_stanza_set_name, 1);
     rb_define_method(cStanza, "text=", t_xmpp_stanza_set_text, 1);
@@ -683,4 +3193,33 @@ void Init_strophe_ruby() {
     rb_define_method(cStanza, "id", t_xmpp_stanza_get_id, 0);
     rb_define_method(cStanza, "id=", t_xmpp_stanza_set_id, 1);
     rb_define_method(cStanza, "type=", t_xmpp_stanza_set_type, 1);
+    rb_define_method(cStanza, "at", t_xmpp_stanza_at, 1);
+    rb_define_method(cStanza, "query", t_xmpp_stanza_query, 1);
+    rb_define_singleton_method(cStanza, "parse", t_xmpp_stanza_parse, -1);
+
+    /*Path*/
+    cPath = rb_define_class_under(mStropheRuby, "Path", rb_cObject);
+    rb_undef_alloc_func(cPath);
+    rb_define_singleton_method(cPath, "compile", t_path_compile, 1);
+    rb_define_method(cPath, "first", t_path_first, 1);
+    rb_define_method(cPath, "all", t_path_all, 1);
+    rb_define_method(cPath, "source", t_path_source, 0);
+    path_cache = rb_hash_new();
+    rb_gc_register_address(&path_cache);
+
+    /*StreamParser*/
+    cStreamParser = rb_define_class_under(mStropheRuby, "StreamParser", rb_cObject);
+    rb_define_alloc_func(cStreamParser, t_stream_parser_alloc);
+    rb_define_method(cStreamParser, "initialize", t_stream_parser_init, -1);
+    rb_define_method(cStreamParser, "feed", t_stream_parser_feed, 1);
+    rb_define_method(cStreamParser, "reset", t_stream_parser_reset, 0);
+    parse_parser = Qnil;
+    rb_gc_register_address(&parse_parser);
+
+    /*XML escaping*/
+    xml_escape_init();
+    escape_kernel = xml_escape_default_kernel();
+    mXML = rb_define_module_under(mStropheRuby, "XML");
+    rb_define_module_function(mXML, "escape", t_xml_escape, -1);
+    rb_define_module_function(mXML, "kernels", t_xml_kernels, 0);
 }
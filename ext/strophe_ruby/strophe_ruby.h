@@ -0,0 +1,68 @@
+/* strophe_ruby.h
+** strophe_ruby -- state shared between the binding's source files
+*/
+
+#ifndef __STROPHE_RUBY_H__
+#define __STROPHE_RUBY_H__
+
+#include <ruby.h>
+#include "strophe.h"
+#include "strophe/common.h"
+#include "async_log.h"
+#include "capture.h"
+#include "mem.h"
+#include "stats.h"
+#include "xml_parser.h"
+
+/* Ruby side of a context. libstrophe allocates through mem (see mem.h), which
+   keeps count of the native bytes so they can be reported to Ruby's GC and in
+   Context#memory_stats. Connections, stream parsers and stanza wrappers each
+   hold a reference, the context is only freed once all of them are gone */
+typedef struct _t_conn_t t_conn_t;
+typedef struct {
+    xmpp_ctx_t *ctx;
+    mem_account_t mem;
+    async_log_t *log;  /* NULL if the context doesn't log */
+    xml_parser_pool_t parsers;  /* expat parsers the connections handed back */
+    t_conn_t *conns;  /* the Ruby side of its connections, rather than conn->userdata */
+    int refs;
+    long stanza_wrappers;
+} t_ctx_t;
+
+/* Ruby side of a connection. libstrophe's connection and stanza handlers and the
+   parser get it as their userdata, the context keeps a list. Connection#clone
+   shares it, refs counts the wrappers. The VALUEs are marked by the wrapper and
+   must be written with RB_OBJ_WRITE, the type is write barrier protected */
+typedef struct _t_route_t t_route_t;
+struct _t_conn_t {
+    xmpp_conn_t *conn;
+    t_ctx_t *tctx;
+    t_conn_t *next;  /* in tctx->conns */
+    int refs;
+    int up;  /* connecting or connected, as far as _conn_handler heard */
+    xml_parser_t *parser;  /* libstrophe's connection owns it, see parser_new */
+
+    /* Handlers given by add_handler / add_id_handler, see t_route_t */
+    t_route_t *routes;    /* one per (name, ns, type) added */
+    VALUE id_handlers;    /* id => Array of Handlers */
+    VALUE raw_handlers;   /* element name => Array of Handlers */
+    VALUE removed;        /* Handlers removed while blocks were running */
+    int dispatching;      /* blocks running, nested */
+    int prune;            /* removed has Handlers, see conn_handlers_prune */
+    VALUE connect_block;  /* block given to connect, or nil */
+    VALUE slow_block;     /* block given to on_slow_handler, or nil */
+    uint64_t slow_ns;     /* slow_handler_threshold, 0 when off */
+
+    stats_conn_t stats;
+    mem_meter_t send_queue;  /* what libstrophe still holds of the data we sent */
+    capture_t *capture;   /* start_capture, NULL when off */
+};
+
+/* strophe_ruby.c */
+void conn_handlers_prune(t_conn_t *tc);
+
+/* event.c */
+void event_run_once(t_ctx_t *tctx, const unsigned long timeout);
+void event_run(t_ctx_t *tctx);
+
+#endif /* __STROPHE_RUBY_H__ */
@@ -0,0 +1,150 @@
+/* xml_escape.c
+** strophe_ruby -- scalar and SIMD XML escaping kernels
+*/
+
+#include <string.h>
+#include "xml_escape.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XML_ESCAPE_X86 1
+#include <immintrin.h>
+#endif
+
+#define NEEDS_ESCAPE(c) ((c) == '&' || (c) == '<' || (c) == '>' || (c) == '"')
+
+static const char *_scan_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+	if (NEEDS_ESCAPE(*p))
+	    return p;
+    }
+    return end;
+}
+
+#ifdef XML_ESCAPE_X86
+
+__attribute__((target("sse2")))
+static const char *_scan_sse2(const char *p, const char *end) {
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+
+    for (; end - p >= 16; p += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+				   _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)));
+	int mask = _mm_movemask_epi8(hit);
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+    return _scan_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *_scan_avx2(const char *p, const char *end) {
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i quot = _mm256_set1_epi8('"');
+
+    for (; end - p >= 32; p += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+				      _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, quot)));
+	unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+    return _scan_sse2(p, end);
+}
+
+#endif /* XML_ESCAPE_X86 */
+
+static const xml_escape_kernel_t kernels[] = {
+    { "scalar", _scan_scalar },
+#ifdef XML_ESCAPE_X86
+    { "sse2", _scan_sse2 },
+    { "avx2", _scan_avx2 },
+#endif
+};
+
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+/* kernels[0 .. usable) run on this CPU, they are listed from slowest to fastest */
+static int usable = 1;
+
+void xml_escape_init(void) {
+#ifdef XML_ESCAPE_X86
+    __builtin_cpu_init();
+    usable = 1;
+    if (__builtin_cpu_supports("sse2")) {
+	usable = 2;
+	if (__builtin_cpu_supports("avx2"))
+	    usable = 3;
+    }
+#endif
+}
+
+const xml_escape_kernel_t *xml_escape_default_kernel(void) {
+    return &kernels[usable - 1];
+}
+
+const xml_escape_kernel_t *xml_escape_kernel(const char *name) {
+    int i;
+
+    for (i = 0; i < usable; i++) {
+	if (strcmp(kernels[i].name, name) == 0)
+	    return &kernels[i];
+    }
+    return NULL;
+}
+
+int xml_escape_kernel_count(void) {
+    return usable;
+}
+
+const xml_escape_kernel_t *xml_escape_kernel_at(int i) {
+    return (i >= 0 && i < usable) ? &kernels[i] : NULL;
+}
+
+/* size of the entity replacing c */
+static size_t _entity_len(char c) {
+    switch (c) {
+    case '&': return 5; /* &amp; */
+    case '"': return 6; /* &quot; */
+    default: return 4;  /* &lt; &gt; */
+    }
+}
+
+size_t xml_escaped_len(const xml_escape_kernel_t *kernel, const char *s, size_t n) {
+    const char *end = s + n;
+    size_t len = n;
+
+    while ((s = kernel->scan(s, end)) < end) {
+	len += _entity_len(*s) - 1;
+	s++;
+    }
+    return len;
+}
+
+char *xml_escape_into(const xml_escape_kernel_t *kernel, char *dst, const char *s, size_t n) {
+    const char *end = s + n;
+    const char *hit;
+
+    while (s < end) {
+	hit = kernel->scan(s, end);
+	memcpy(dst, s, hit - s);
+	dst += hit - s;
+	if (hit == end)
+	    break;
+	switch (*hit) {
+	case '&': memcpy(dst, "&amp;", 5); break;
+	case '<': memcpy(dst, "&lt;", 4); break;
+	case '>': memcpy(dst, "&gt;", 4); break;
+	default: memcpy(dst, "&quot;", 6); break;
+	}
+	dst += _entity_len(*hit);
+	s = hit + 1;
+    }
+    return dst;
+}
@@ -0,0 +1,43 @@
+/* xml_escape.h
+** strophe_ruby -- XML escaping shared by the stanza serializer
+**
+** The scan kernels look for the next byte that needs escaping (&, <, > or ")
+** so that the clean runs in between can be copied in bulk. A vector kernel
+** is picked at load time from what the CPU supports, the scalar one is the
+** portable fallback and the reference the others are tested against.
+*/
+
+#ifndef __STROPHE_RUBY_XML_ESCAPE_H__
+#define __STROPHE_RUBY_XML_ESCAPE_H__
+
+#include <stddef.h>
+
+/* return the first byte in [p, end) that must be escaped, or end */
+typedef const char *(*xml_escape_scan_fn)(const char *p, const char *end);
+
+typedef struct {
+    const char *name;
+    xml_escape_scan_fn scan;
+} xml_escape_kernel_t;
+
+/* pick the fastest kernel the CPU supports. Call once before escaping */
+void xml_escape_init(void);
+
+/* the kernel picked by xml_escape_init */
+const xml_escape_kernel_t *xml_escape_default_kernel(void);
+
+/* look a kernel up by name ("scalar", "sse2", "avx2"), NULL if the CPU can't run it */
+const xml_escape_kernel_t *xml_escape_kernel(const char *name);
+
+/* number of kernels usable on this CPU, and the i-th of them */
+int xml_escape_kernel_count(void);
+const xml_escape_kernel_t *xml_escape_kernel_at(int i);
+
+/* length of the n bytes at s once escaped */
+size_t xml_escaped_len(const xml_escape_kernel_t *kernel, const char *s, size_t n);
+
+/* escape the n bytes at s into dst, which has room for xml_escaped_len bytes.
+   Returns the end of the written data */
+char *xml_escape_into(const xml_escape_kernel_t *kernel, char *dst, const char *s, size_t n);
+
+#endif /* __STROPHE_RUBY_XML_ESCAPE_H__ */
@@ -0,0 +1,708 @@
+/* xml_parser.c
+** strophe_ruby -- the XML parser behind libstrophe's connections
+*/
+
+#include <string.h>
+#include "async_log.h"
+#include "mem.h"
+#include "probes.h"
+#include "xml_parser.h"
+
+/* first allocation for a text node, doubled as chunks keep coming */
+#define TEXT_MIN_CAPACITY 256
+
+static const char * const limit_names[XML_PARSER_LIMIT_COUNT] = {
+    "bytes", "depth", "children", "attributes"
+};
+
+/* xmpp_disconnect closes the stream after it */
+static const char stream_error_policy_violation[] =
+    "<stream:error><policy-violation xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
+    "</stream:error>";
+
+/* what libstrophe's connections hold, see parser_new */
+struct _parser_t {
+    xml_parser_t parser;
+};
+
+/* an expat parser ready for a new document, reused from the pool if possible */
+static XML_Parser _pool_get(xml_parser_pool_t * const pool) {
+    if (pool->count > 0) {
+	pool->stats.reused++;
+	return pool->idle[--pool->count];
+    }
+    pool->stats.created++;
+    return mem_parser_create();
+}
+
+static int _text_append(xml_parser_t * const parser, const char *s, int len) {
+    size_t need = parser->text_len + len + 1;
+    size_t cap;
+    char *text;
+
+    if (need > parser->text_cap) {
+	cap = parser->text_cap ? parser->text_cap : TEXT_MIN_CAPACITY;
+	while (cap < need)
+	    cap *= 2;
+	text = xmpp_realloc(parser->ctx, parser->text, cap);
+	if (!text)
+	    return 0;
+	parser->text = text;
+	parser->text_cap = cap;
+    }
+    memcpy(parser->text + parser->text_len, s, len);
+    parser->text_len += len;
+    return 1;
+}
+
+/* turn the accumulated text into one text child of the current element */
+static void _text_flush(xml_parser_t * const parser) {
+    xmpp_stanza_t *text;
+    char *data;
+
+    mem_scope_t scope;
+
+    if (!parser->text_len)
+	return;
+    scope = mem_scope_enter(NULL, MEM_STANZA);
+    if (!parser->stanza || !(text = xmpp_stanza_new(parser->ctx))) {
+	parser->text_len = 0;
+	mem_scope_leave(scope);
+	return;
+    }
+    mem_stanzas_built(text);
+
+    data = xmpp_realloc(parser->ctx, parser->text, parser->text_len + 1);
+    if (!data)
+	data = parser->text;
+    data[parser->text_len] = '\0';
+
+    /* the buffer becomes the node's data, no copy */
+    text->type = XMPP_STANZA_TEXT;
+    text->data = data;
+    xmpp_stanza_add_child(parser->stanza, text);
+    mem_stanza_release(text);
+    mem_scope_leave(scope);
+
+    parser->text = NULL;
+    parser->text_len = parser->text_cap = 0;
+}
+
+/* append len bytes to the captured element */
+static int _raw_append(xml_parser_t * const parser, const char *data, size_t len) {
+    xml_parser_raw_t *raw = &parser->raw;
+    size_t cap;
+    char *buf;
+
+    if (raw->dropped)
+	return 0;
+    if (raw->len + len > raw->cap) {
+	cap = raw->cap ? raw->cap : TEXT_MIN_CAPACITY;
+	while (cap < raw->len + len)
+	    cap *= 2;
+	buf = xmpp_realloc(parser->ctx, raw->buf, cap);
+	if (!buf) {
+	    /* out of memory, skip this element but keep tracking it */
+	    xmpp_error(parser->ctx, "xmpp", "dropped raw %s stanza, out of memory", raw->name);
+	    raw->dropped = 1;
+	    return 0;
+	}
+	raw->buf = buf;
+	raw->cap = cap;
+    }
+    memcpy(raw->buf + raw->len, data, len);
+    raw->len += len;
+    return 1;
+}
+
+/* append the bytes of the current chunk from raw.pos up to stream offset end */
+static int _raw_copy(xml_parser_t * const parser, long end) {
+    xml_parser_raw_t *raw = &parser->raw;
+    int ok = _raw_append(parser, parser->chunk + (raw->pos - parser->chunk_base), end - raw->pos);
+
+    raw->pos = end;
+    return ok;
+}
+
+static void _raw_clear(xml_parser_t * const parser) {
+    xml_parser_raw_t *raw = &parser->raw;
+    xmpp_ctx_t *ctx = parser->ctx;
+
+    if (raw->name) xmpp_free(ctx, raw->name);
+    if (raw->type) xmpp_free(ctx, raw->type);
+    if (raw->from) xmpp_free(ctx, raw->from);
+    raw->name = raw->type = raw->from = NULL;
+    raw->active = 0;
+    raw->dropped = 0;
+    raw->len = 0;
+}
+
+static const char *_attr_value(const XML_Char **attr, const char *key) {
+    for (; attr && attr[0]; attr += 2) {
+	if (strcmp(attr[0], key) == 0)
+	    return attr[1];
+    }
+    return NULL;
+}
+
+/* start capturing a toplevel element if it was registered as raw */
+static void _raw_start(xml_parser_t * const parser, const XML_Char *name, const XML_Char **attr) {
+    xml_parser_raw_t *raw = &parser->raw;
+    xmpp_ctx_t *ctx = parser->ctx;
+    const char *val, *context;
+    int i, offset, size;
+
+    if (!raw->count || !parser->authenticated)
+	return;
+    for (i = 0; i < raw->count && strcmp(raw->names[i], name) != 0; i++);
+    if (i == raw->count)
+	return;
+
+    raw->active = 1;
+    raw->pos = XML_GetCurrentByteIndex(parser->expat);
+    raw->start_len = XML_GetCurrentByteCount(parser->expat);
+    raw->len = 0;
+    raw->tree = !parser->wants_tree || parser->wants_tree(parser, name);
+    raw->name = xmpp_strdup(ctx, name);
+    if (raw->pos < parser->chunk_base) {
+	/* the start tag began in an earlier chunk, only expat's buffer still has all of it */
+	context = XML_GetInputContext(parser->expat, &offset, &size);
+	if (!context || offset + raw->start_len > size) {
+	    xmpp_error(ctx, "xmpp", "dropped raw %s stanza, start tag out of reach", name);
+	    raw->dropped = 1;
+	} else {
+	    _raw_append(parser, context + offset, raw->start_len);
+	}
+	raw->pos += raw->start_len;
+	raw->start_len = 0;
+    }
+    val = _attr_value(attr, "type");
+    raw->type = val ? xmpp_strdup(ctx, val) : NULL;
+    val = _attr_value(attr, "from");
+    raw->from = val ? xmpp_strdup(ctx, val) : NULL;
+}
+
+/* the captured toplevel element just closed, hand its bytes over */
+static void _raw_end(xml_parser_t * const parser) {
+    xml_parser_raw_t *raw = &parser->raw;
+    XML_Parser xml = parser->expat;
+    int count = XML_GetCurrentByteCount(xml);
+    long end;
+
+    /* an <empty/> element ends within its start tag */
+    end = count ? XML_GetCurrentByteIndex(xml) + count : raw->pos + raw->start_len;
+
+    if (raw->dropped) {
+	/* already logged */
+    } else if (raw->len == 0) {
+	/* the whole element sits in this chunk, no need to copy it */
+	parser->deliver_raw(parser, parser->chunk + (raw->pos - parser->chunk_base),
+			    end - raw->pos, raw->name, raw->type, raw->from);
+    } else if (_raw_copy(parser, end)) {
+	parser->deliver_raw(parser, raw->buf, raw->len, raw->name, raw->type, raw->from);
+    }
+    _raw_clear(parser);
+}
+
+/* free the stanza being built. parser->stanza is its innermost open element, the
+   parents hold the references, so the whole tree goes from the top */
+static void _stanza_discard(xml_parser_t * const parser) {
+    xmpp_stanza_t *root = parser->stanza;
+
+    if (!root)
+	return;
+    while (root->parent)
+	root = root->parent;
+    mem_stanza_release(root);
+    parser->stanza = NULL;
+}
+
+/* open an element of the stanza being built, as libstrophe's parser does. 0 if out of memory */
+static int _stanza_open(xml_parser_t * const parser, const XML_Char *name, const XML_Char **attr) {
+    xmpp_stanza_t *child = xmpp_stanza_new(parser->ctx);
+    mem_scope_t scope;
+    int ok = 1;
+
+    if (!child)
+	return 0;
+    mem_stanzas_built(child);
+    if (xmpp_stanza_set_name(child, name) != XMPP_EOK) {
+	mem_stanza_release(child);
+	return 0;
+    }
+    /* the attributes go in the stanza's table, charged to the hash category */
+    scope = mem_scope_enter(NULL, MEM_HASH);
+    for (; ok && attr && attr[0]; attr += 2)
+	ok = xmpp_stanza_set_attribute(child, attr[0], attr[1]) == XMPP_EOK;
+    mem_scope_leave(scope);
+    if (!ok) {
+	mem_stanza_release(child);
+	return 0;
+    }
+    if (parser->stanza) {
+	/* the parent takes its own reference */
+	xmpp_stanza_add_child(parser->stanza, child);
+	mem_stanza_release(child);
+    }
+    parser->stanza = child;
+    return 1;
+}
+
+/* the current stanza went over a limit: free what was built of it and skip the rest,
+   or stop the stream. Returns 0 so callers can bail out */
+static int _limit_hit(xml_parser_t * const parser, const xml_parser_limit_t limit) {
+    xml_parser_limits_t *limits = &parser->limits;
+
+    limits->hits[limit]++;
+    xmpp_warn(parser->ctx, "xmpp", "stanza over the %s limit of %lu, %s", limit_names[limit],
+	      limits->max[limit], limits->action == XML_PARSER_LIMIT_DROP ? "dropping it" : "closing the stream");
+
+    _stanza_discard(parser);
+    parser->text_len = 0;
+    if (parser->raw.active)
+	parser->raw.dropped = 1;
+
+    /* expat may still call back before it stops, skipping covers that too */
+    limits->skip = 1;
+    if (limits->action == XML_PARSER_LIMIT_ABORT) {
+	limits->aborted = 1;
+	limits->exceeded = limit;
+	if (parser->live) {
+	    xmpp_send_raw_string(parser->conn, stream_error_policy_violation);
+	    xmpp_disconnect(parser->conn);
+	}
+	XML_StopParser(parser->expat, XML_FALSE);
+    }
+    return 0;
+}
+
+/* the next stanza can't start before the end of the current event */
+static void _limit_mark(xml_parser_t * const parser, const long end) {
+    parser->limits.start = end;
+}
+
+/* check the size of the current stanza, or of what might become one, up to stream offset end */
+static int _limit_bytes(xml_parser_t * const parser, const long end) {
+    xml_parser_limits_t *limits = &parser->limits;
+
+    if (limits->max[XML_PARSER_LIMIT_BYTES] && parser->depth >= 1 &&
+	(unsigned long)(end - limits->start) > limits->max[XML_PARSER_LIMIT_BYTES])
+	return _limit_hit(parser, XML_PARSER_LIMIT_BYTES);
+    return 1;
+}
+
+/* account for an element about to be started, before anything is built for it */
+static int _limit_start(xml_parser_t * const parser, const XML_Char **attr) {
+    xml_parser_limits_t *limits = &parser->limits;
+    XML_Parser xml = parser->expat;
+    int depth = parser->depth;  /* 1 for the toplevel element */
+    unsigned long *children, n;
+    int cap;
+
+    if (depth == 1)
+	limits->start = XML_GetCurrentByteIndex(xml);
+
+    if (limits->max[XML_PARSER_LIMIT_DEPTH] && (unsigned long)depth > limits->max[XML_PARSER_LIMIT_DEPTH])
+	return _limit_hit(parser, XML_PARSER_LIMIT_DEPTH);
+
+    if (limits->max[XML_PARSER_LIMIT_ATTRIBUTES]) {
+	for (n = 0; attr && attr[2 * n]; n++);
+	if (n > limits->max[XML_PARSER_LIMIT_ATTRIBUTES])
+	    return _limit_hit(parser, XML_PARSER_LIMIT_ATTRIBUTES);
+    }
+
+    if (limits->max[XML_PARSER_LIMIT_CHILDREN]) {
+	if (depth >= limits->children_cap) {
+	    cap = limits->children_cap ? limits->children_cap : 16;
+	    while (cap <= depth)
+		cap *= 2;
+	    children = xmpp_realloc(parser->ctx, limits->children, cap * sizeof(*children));
+	    if (!children)
+		return _limit_hit(parser, XML_PARSER_LIMIT_DEPTH);
+	    limits->children = children;
+	    limits->children_cap = cap;
+	}
+	limits->children[depth] = 0;
+	if (depth > 1 && ++limits->children[depth - 1] > limits->max[XML_PARSER_LIMIT_CHILDREN])
+	    return _limit_hit(parser, XML_PARSER_LIMIT_CHILDREN);
+    }
+
+    return _limit_bytes(parser, XML_GetCurrentByteIndex(xml) + XML_GetCurrentByteCount(xml));
+}
+
+/* log a received stanza at DEBUG */
+static void _log_recv(xml_parser_t * const parser, xmpp_stanza_t * const stanza) {
+    char *buf;
+    size_t len;
+
+    if (!async_log_wants(parser->ctx, XMPP_LEVEL_DEBUG))
+	return;
+    if (xmpp_stanza_to_text(stanza, &buf, &len) == 0) {
+	xmpp_debug(parser->ctx, "xmpp", "RECV: %s", buf);
+	xmpp_free(parser->ctx, buf);
+    }
+}
+
+/* a complete stanza on a live stream: what libstrophe's stanza callback does, except that
+   it is only serialized for the log when the log wants it */
+static void _deliver_live(xml_parser_t * const parser, xmpp_stanza_t * const stanza) {
+    _log_recv(parser, stanza);
+    PROBE_DISPATCH_START(parser->conn, stanza->data, parser->stats ? parser->stats->read_at : 0);
+    handler_fire_stanza(parser->conn, stanza);
+    PROBE_DISPATCH_DONE(parser->conn, stanza->data);
+    mem_stanza_release(stanza);
+}
+
+static void _handle_start(void *userdata, const XML_Char *name, const XML_Char **attr) {
+    xml_parser_t *parser = (xml_parser_t *)userdata;
+    mem_scope_t scope;
+    int opened;
+
+    _text_flush(parser);
+    if (parser->depth == 0 && parser->limits.enabled)
+	_limit_mark(parser, XML_GetCurrentByteIndex(parser->expat) + XML_GetCurrentByteCount(parser->expat));
+    if (parser->depth == 0) {
+	/* the stream element is libstrophe's business, offline it carries nothing we need */
+	if (parser->live)
+	    parser->startcb((char *)name, (char **)attr, parser->conn);
+	parser->depth++;
+	return;
+    }
+    if (parser->depth == 1 && parser->stats)
+	stats_stanza(parser->stats, name, _attr_value(attr, "type"), 0);
+    if (parser->limits.skip) {
+	parser->depth++;
+	return;
+    }
+    if (parser->depth == 1 && parser->deliver_raw)
+	_raw_start(parser, name, attr);
+    if (parser->limits.enabled && !_limit_start(parser, attr)) {
+	parser->depth++;
+	return;
+    }
+    if (parser->raw.active && !parser->raw.tree) {
+	/* raw only, don't build anything */
+	parser->depth++;
+	return;
+    }
+    if (parser->depth > 1 && !parser->stanza) {
+	/* the stanza was dropped */
+	parser->depth++;
+	return;
+    }
+    scope = mem_scope_enter(NULL, MEM_STANZA);
+    opened = _stanza_open(parser, name, attr);
+    mem_scope_leave(scope);
+    if (!opened) {
+	xmpp_error(parser->ctx, "xmpp", "dropped %s stanza, out of memory", name);
+	_stanza_discard(parser);
+    }
+    parser->depth++;
+}
+
+static void _handle_end(void *userdata, const XML_Char *name) {
+    xml_parser_t *parser = (xml_parser_t *)userdata;
+    xmpp_stanza_t *stanza;
+    mem_scope_t scope;
+
+    _text_flush(parser);
+    if (parser->depth == 2 && parser->limits.enabled)
+	_limit_mark(parser, XML_GetCurrentByteIndex(parser->expat) + XML_GetCurrentByteCount(parser->expat));
+    if (parser->limits.skip) {
+	if (parser->depth == 2) {
+	    if (parser->raw.active)
+		_raw_end(parser);
+	    parser->limits.skip = 0;
+	}
+	parser->depth--;
+	return;
+    }
+    if (parser->raw.active) {
+	int tree = parser->raw.tree;
+
+	if (parser->depth == 2)
+	    _raw_end(parser);
+	if (!tree) {
+	    parser->depth--;
+	    return;
+	}
+    }
+
+    parser->depth--;
+    if (parser->depth == 0) {
+	if (parser->live)
+	    parser->endcb((char *)name, parser->conn);
+	return;
+    }
+    if (!parser->stanza)
+	return;
+    if (parser->stanza->parent) {
+	parser->stanza = parser->stanza->parent;
+    } else {
+	stanza = parser->stanza;
+	parser->stanza = NULL;
+	scope = mem_scope_enter(NULL, MEM_STANZA);
+	if (parser->live)
+	    _deliver_live(parser, stanza);
+	else
+	    parser->deliver(parser, stanza);
+	mem_scope_leave(scope);
+    }
+}
+
+static void _handle_character(void *userdata, const XML_Char *s, int len) {
+    xml_parser_t *parser = (xml_parser_t *)userdata;
+
+    /* same rule as libstrophe: no text outside of stanzas */
+    if (parser->depth == 1 && parser->limits.enabled)
+	_limit_mark(parser, XML_GetCurrentByteIndex(parser->expat) + len);
+    if (parser->depth < 2 || parser->limits.skip)
+	return;
+    if (parser->limits.enabled && !_limit_bytes(parser, XML_GetCurrentByteIndex(parser->expat) + len))
+	return;
+    if (parser->raw.active && !parser->raw.tree)
+	return;
+    _text_append(parser, s, len);
+}
+
+void xml_parser_init(xml_parser_t * const parser, xmpp_ctx_t * const ctx,
+		     xml_parser_pool_t * const pool) {
+    memset(parser, 0, sizeof(*parser));
+    parser->ctx = ctx;
+    parser->pool = pool;
+}
+
+void xml_parser_free(xml_parser_t * const parser) {
+    xmpp_ctx_t *ctx = parser->ctx;
+    int i;
+
+    if (parser->text)
+	xmpp_free(ctx, parser->text);
+    parser->text = NULL;
+    parser->text_len = parser->text_cap = 0;
+
+    _raw_clear(parser);
+    if (parser->raw.buf)
+	xmpp_free(ctx, parser->raw.buf);
+    for (i = 0; i < parser->raw.count; i++)
+	xmpp_free(ctx, parser->raw.names[i]);
+    if (parser->raw.names)
+	xmpp_free(ctx, parser->raw.names);
+    parser->raw.buf = NULL;
+    parser->raw.names = NULL;
+    parser->raw.count = 0;
+
+    if (parser->limits.children)
+	xmpp_free(ctx, parser->limits.children);
+    parser->limits.children = NULL;
+    parser->limits.children_cap = 0;
+}
+
+void xml_parser_set_limit(xml_parser_t * const parser, const xml_parser_limit_t limit,
+			  const unsigned long max) {
+    xml_parser_limits_t *limits = &parser->limits;
+    int i;
+
+    limits->max[limit] = max;
+    limits->enabled = 0;
+    for (i = 0; i < XML_PARSER_LIMIT_COUNT; i++)
+	limits->enabled |= limits->max[i] != 0;
+}
+
+const char *xml_parser_limit_name(const xml_parser_limit_t limit) {
+    return limit_names[limit];
+}
+
+int xml_parser_add_raw(xml_parser_t * const parser, const char * const name) {
+    xml_parser_raw_t *raw = &parser->raw;
+    xmpp_ctx_t *ctx = parser->ctx;
+    char **names;
+    int i;
+
+    for (i = 0; i < raw->count; i++) {
+	if (strcmp(raw->names[i], name) == 0)
+	    return 1;
+    }
+    names = xmpp_realloc(ctx, raw->names, (raw->count + 1) * sizeof(char *));
+    if (!names)
+	return 0;
+    raw->names = names;
+    if (!(raw->names[raw->count] = xmpp_strdup(ctx, name)))
+	return 0;
+    raw->count++;
+    return 1;
+}
+
+void xml_parser_remove_raw(xml_parser_t * const parser, const char * const name) {
+    xml_parser_raw_t *raw = &parser->raw;
+    int i;
+
+    for (i = 0; i < raw->count && strcmp(raw->names[i], name) != 0; i++);
+    if (i == raw->count)
+	return;
+    xmpp_free(parser->ctx, raw->names[i]);
+    raw->names[i] = raw->names[--raw->count];
+}
+
+int xml_parser_reset(xml_parser_t * const parser) {
+    mem_scope_t scope = mem_scope_enter(mem_account_of(parser->ctx), MEM_PARSER);
+
+    _stanza_discard(parser);
+    parser->depth = 0;
+    parser->text_len = 0;
+    parser->chunk_base = 0;
+    _raw_clear(parser);
+    parser->limits.skip = 0;
+    parser->limits.aborted = 0;
+
+    /* restart the document in place, this drops our handlers too */
+    if (parser->expat && !XML_ParserReset(parser->expat, NULL)) {
+	XML_ParserFree(parser->expat);
+	parser->expat = NULL;
+    }
+    if (parser->expat) {
+	parser->pool->stats.resets++;
+    } else if (!(parser->expat = _pool_get(parser->pool))) {
+	mem_scope_leave(scope);
+	return 0;
+    }
+
+    XML_SetUserData(parser->expat, parser);
+    XML_SetElementHandler(parser->expat, _handle_start, _handle_end);
+    XML_SetCharacterDataHandler(parser->expat, _handle_character);
+    mem_scope_leave(scope);
+    return 1;
+}
+
+void xml_parser_release(xml_parser_t * const parser) {
+    xml_parser_pool_t *pool = parser->pool;
+    XML_Parser xml = parser->expat;
+    mem_scope_t scope;
+
+    _stanza_discard(parser);
+    parser->expat = NULL;
+    if (!xml)
+	return;
+
+    /* XML_ParserReset may allocate, charge it like the rest of the parser */
+    scope = mem_scope_enter(mem_account_of(parser->ctx), MEM_PARSER);
+    if (pool->count < XML_PARSER_POOL_MAX_IDLE && XML_ParserReset(xml, NULL))
+	pool->idle[pool->count++] = xml;
+    else
+	XML_ParserFree(xml);
+    mem_scope_leave(scope);
+}
+
+void xml_parser_pool_free(xml_parser_pool_t * const pool) {
+    while (pool->count > 0)
+	XML_ParserFree(pool->idle[--pool->count]);
+}
+
+void xml_parser_pool_stats(const xml_parser_pool_t * const pool, xml_parser_pool_stats_t * const stats) {
+    *stats = pool->stats;
+    stats->idle = pool->count;
+}
+
+xml_parser_t *xml_parser_of(const xml_parser_pool_t * const pool, const xmpp_conn_t * const conn) {
+    xml_parser_t *parser;
+
+    for (parser = pool->conns; parser && parser->conn != conn; parser = parser->next);
+    return parser;
+}
+
+int xml_parser_feed(xml_parser_t * const parser, const char * const buf, const size_t len) {
+    mem_scope_t scope;
+    int ret;
+
+    /* the stream is being closed, see _limit_hit */
+    if (parser->limits.aborted)
+	return 0;
+    if (!parser->expat && !xml_parser_reset(parser))
+	return 0;
+
+    parser->chunk = buf;
+    scope = mem_scope_enter(mem_account_of(parser->ctx), MEM_PARSER);
+    ret = XML_Parse(parser->expat, buf, (int)len, 0) != XML_STATUS_ERROR;
+
+    /* expat buffers an unfinished start tag without calling back, catch it growing */
+    if (ret && parser->limits.enabled && !parser->limits.skip &&
+	!_limit_bytes(parser, parser->chunk_base + len))
+	ret = parser->limits.action != XML_PARSER_LIMIT_ABORT;
+
+    /* a raw element continues in the next chunk, keep what we have of it */
+    if (ret && parser->raw.active)
+	_raw_copy(parser, parser->chunk_base + len);
+    parser->chunk = NULL;
+    parser->chunk_base += len;
+    mem_scope_leave(scope);
+    return ret;
+}
+
+/* libstrophe's parser interface (strophe/parser.h). xmpp_conn_new makes one for every
+   connection, with the connection as userdata, and the event loop drives it. It starts
+   out offline, the binding sets it live when the connection connects */
+
+parser_t *parser_new(xmpp_ctx_t *ctx,
+		     parser_start_callback startcb,
+		     parser_end_callback endcb,
+		     parser_stanza_callback stanzacb,
+		     void *userdata) {
+    xml_parser_pool_t *pool = ctx_parser_pool(ctx);
+    mem_scope_t scope;
+    parser_t *p;
+
+    /* complete stanzas go to the handlers straight from here, see _deliver_live */
+    (void)stanzacb;
+    if (!pool)
+	return NULL;
+    scope = mem_scope_enter(mem_account_of(ctx), MEM_PARSER);
+    p = xmpp_alloc(ctx, sizeof(*p));
+    mem_scope_leave(scope);
+    if (!p)
+	return NULL;
+    xml_parser_init(&p->parser, ctx, pool);
+    p->parser.conn = (xmpp_conn_t *)userdata;
+    p->parser.startcb = startcb;
+    p->parser.endcb = endcb;
+    if (!xml_parser_reset(&p->parser)) {
+	xmpp_free(ctx, p);
+	return NULL;
+    }
+    p->parser.next = pool->conns;
+    pool->conns = &p->parser;
+    return p;
+}
+
+void parser_free(parser_t *p) {
+    xml_parser_t *parser = &p->parser;
+    xml_parser_t **link;
+
+    for (link = &parser->pool->conns; *link && *link != parser; link = &(*link)->next);
+    if (*link)
+	*link = parser->next;
+    xml_parser_release(parser);
+    xml_parser_free(parser);
+    xmpp_free(parser->ctx, p);
+}
+
+int parser_reset(parser_t *p) {
+    xml_parser_t *parser = &p->parser;
+
+    if (parser->tap)
+	parser->tap(parser, NULL, 0);
+    return xml_parser_reset(parser);
+}
+
+/* a chunk read from the socket. A stanza over a limit has the stream closed by now, the
+   rest of the input is ignored rather than have libstrophe drop the connection at once */
+int parser_feed(parser_t *p, char *chunk, int len) {
+    xml_parser_t *parser = &p->parser;
+    int ret;
+
+    if (parser->tap)
+	parser->tap(parser, chunk, len);
+    PROBE_PARSE_START(parser->conn, len);
+    ret = xml_parser_feed(parser, chunk, len);
+    PROBE_PARSE_DONE(parser->conn, len, ret);
+    return ret || parser->limits.aborted;
+}
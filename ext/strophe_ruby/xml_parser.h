@@ -0,0 +1,212 @@
+/* xml_parser.h
+** strophe_ruby -- the XML parser behind libstrophe's connections
+**
+** libstrophe's connections parse through parser_new/parser_free/
+** parser_reset/parser_feed (strophe/parser.h). xml_parser.c defines those,
+** so they take the place of libstrophe's own parser_expat.o when the
+** extension links against the archive: every connection gets one of these
+** from xmpp_conn_new, the event loop feeds it what it reads and resets it on
+** stream restarts. Stanzas are built the way libstrophe's parser builds them,
+** but character data is accumulated here: adjacent chunks are merged into a
+** single text node kept in a geometrically growing buffer, which is shrunk
+** once when the node is complete.
+**
+** A parser is "live" when it sits on a connected stream: depth 0 is then the
+** stream element, handed to libstrophe's stream callbacks, and complete
+** stanzas go to the connection's handlers, only serialized for the RECV debug
+** line when the log wants it. Offline parsers (Connection#feed on a
+** connection that isn't connected, StreamParser) skip the stream element and
+** hand each stanza to the deliver callback instead. Nothing here needs the
+** GVL, deliver callbacks that don't either can be fed with it released.
+**
+** Toplevel elements whose name was registered with xml_parser_add_raw are
+** also captured as raw bytes: the byte range of the element is cut out of
+** the fed chunks and passed to deliver_raw. When nothing else is interested
+** in such a stanza (wants_tree says so) no tree is built for it at all.
+**
+** Per-connection limits on the bytes, depth, children per element and
+** attributes per element of a stanza are checked as the stanza is parsed.
+** A stanza over a limit is either dropped (its partial tree is freed and the
+** rest of it skipped) or ends the stream with a policy-violation error.
+**
+** Expat parsers are reset in place with XML_ParserReset on stream restarts,
+** and parsers going away hand theirs to a pool kept per context, where the
+** next one picks it up. Both keep expat's internal buffers.
+*/
+
+#ifndef __STROPHE_RUBY_XML_PARSER_H__
+#define __STROPHE_RUBY_XML_PARSER_H__
+
+#include "strophe.h"
+#include "strophe/common.h"
+#include "strophe/expat.h"
+#include "stats.h"
+
+typedef struct _xml_parser_t xml_parser_t;
+
+/* idle expat parsers kept per context. A reset parser keeps the buffers it
+   grew, so this also bounds the memory sitting idle */
+#define XML_PARSER_POOL_MAX_IDLE 256
+
+typedef struct {
+    unsigned long created;  /* XML_ParserCreate calls */
+    unsigned long reused;   /* parsers taken from the pool instead */
+    unsigned long resets;   /* stream restarts done in place */
+    int idle;               /* parsers sitting in the pool */
+} xml_parser_pool_stats_t;
+
+typedef struct {
+    XML_Parser idle[XML_PARSER_POOL_MAX_IDLE];
+    int count;
+    xml_parser_pool_stats_t stats;
+    xml_parser_t *conns;  /* the parsers of the context's connections, see xml_parser_of */
+} xml_parser_pool_t;
+
+/* receives a complete toplevel stanza from an offline parser and owns the reference */
+typedef void (*xml_parser_deliver)(xml_parser_t * const parser, xmpp_stanza_t * const stanza);
+
+/* sees every chunk libstrophe reads before it is parsed, and buf NULL on stream restarts */
+typedef void (*xml_parser_tap)(xml_parser_t * const parser, const char * const buf, const size_t len);
+
+/* does anything besides the raw handlers want the tree of a toplevel element with this name? */
+typedef int (*xml_parser_wants_tree)(xml_parser_t * const parser, const char * const name);
+
+/* receives the serialized bytes of a raw toplevel element, type and from may be NULL */
+typedef void (*xml_parser_deliver_raw)(xml_parser_t * const parser,
+				       const char * const xml, const size_t len,
+				       const char * const name, const char * const type,
+				       const char * const from);
+
+typedef enum {
+    XML_PARSER_LIMIT_BYTES,
+    XML_PARSER_LIMIT_DEPTH,
+    XML_PARSER_LIMIT_CHILDREN,
+    XML_PARSER_LIMIT_ATTRIBUTES,
+    XML_PARSER_LIMIT_COUNT
+} xml_parser_limit_t;
+
+/* what happens to a stanza over a limit */
+typedef enum {
+    XML_PARSER_LIMIT_ABORT,  /* stream error, parsing stops */
+    XML_PARSER_LIMIT_DROP    /* the stanza is skipped, the stream goes on */
+} xml_parser_limit_action_t;
+
+typedef struct {
+    unsigned long max[XML_PARSER_LIMIT_COUNT];  /* 0 means no limit */
+    xml_parser_limit_action_t action;
+    unsigned long hits[XML_PARSER_LIMIT_COUNT];
+    int enabled;   /* any max set */
+
+    long start;    /* stream offset of the current toplevel element */
+    unsigned long *children;  /* element children so far, by depth */
+    int children_cap;
+    int skip;      /* dropping the current stanza */
+    int aborted;   /* stopped the parser because of ... */
+    xml_parser_limit_t exceeded;  /* ... this limit */
+} xml_parser_limits_t;
+
+typedef struct {
+    /* names of the toplevel elements to capture */
+    char **names;
+    int count;
+
+    int active;   /* capturing the current toplevel element */
+    int tree;     /* ... and building its stanza as usual */
+    int dropped;  /* ran out of memory while copying it */
+    long pos;     /* stream offset of the first byte not copied yet */
+    long end;     /* stream offset just past the element once it's closed */
+    int start_len; /* size of the start tag, for <empty/> elements */
+
+    /* bytes of an element spanning several chunks */
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    char *name;
+    char *type;
+    char *from;
+} xml_parser_raw_t;
+
+struct _xml_parser_t {
+    xmpp_ctx_t *ctx;
+    xmpp_conn_t *conn;  /* NULL for a StreamParser */
+    xml_parser_pool_t *pool;
+    xml_parser_t *next;  /* in pool->conns */
+    int live;
+    int authenticated;  /* user handlers run, raw ones included */
+
+    XML_Parser expat;
+    int depth;
+    xmpp_stanza_t *stanza;  /* innermost element of the stanza being built */
+
+    /* libstrophe's stream callbacks, for the stream element of a live parser */
+    parser_start_callback startcb;
+    parser_end_callback endcb;
+
+    /* pending character data for the current element */
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+
+    /* offline mode only */
+    xml_parser_deliver deliver;
+    void *userdata;
+
+    xml_parser_tap tap;
+
+    /* the chunk being parsed and its offset in the stream */
+    const char *chunk;
+    long chunk_base;
+
+    xml_parser_raw_t raw;
+    xml_parser_deliver_raw deliver_raw;
+    xml_parser_wants_tree wants_tree;  /* NULL builds every tree */
+
+    xml_parser_limits_t limits;
+
+    /* counts the toplevel elements received when set */
+    stats_conn_t *stats;
+};
+
+/* a parser of the binding's own, eg. for a StreamParser. pool is the context's, where the
+   expat parser comes from and goes back to */
+void xml_parser_init(xml_parser_t * const parser, xmpp_ctx_t * const ctx,
+		     xml_parser_pool_t * const pool);
+
+/* drop the pending text and the raw and limit state */
+void xml_parser_free(xml_parser_t * const parser);
+
+/* start a new document */
+int xml_parser_reset(xml_parser_t * const parser);
+
+/* the parser is going away, put its expat parser back into the pool */
+void xml_parser_release(xml_parser_t * const parser);
+
+/* the parser libstrophe made for conn, NULL if there is none */
+xml_parser_t *xml_parser_of(const xml_parser_pool_t * const pool, const xmpp_conn_t * const conn);
+
+/* strophe_ruby.c: the pool of a context the binding made, NULL for any other */
+xml_parser_pool_t *ctx_parser_pool(const xmpp_ctx_t * const ctx);
+
+/* free the idle parsers of a context before the context itself */
+void xml_parser_pool_free(xml_parser_pool_t * const pool);
+
+void xml_parser_pool_stats(const xml_parser_pool_t * const pool, xml_parser_pool_stats_t * const stats);
+
+/* capture toplevel elements with this name as raw bytes */
+int xml_parser_add_raw(xml_parser_t * const parser, const char * const name);
+
+/* stop capturing them, an element being captured is still delivered */
+void xml_parser_remove_raw(xml_parser_t * const parser, const char * const name);
+
+/* set one limit, 0 removes it */
+void xml_parser_set_limit(xml_parser_t * const parser, const xml_parser_limit_t limit,
+			  const unsigned long max);
+
+/* "bytes", "depth", "children" or "attributes" */
+const char *xml_parser_limit_name(const xml_parser_limit_t limit);
+
+/* parse len bytes, returns 0 on a parse error or a limit aborting the stream */
+int xml_parser_feed(xml_parser_t * const parser, const char * const buf, const size_t len);
+
+#endif /* __STROPHE_RUBY_XML_PARSER_H__ */
@@ -1,11 +1,517 @@
 require File.dirname(__FILE__) + '/test_helper.rb'
+require 'tmpdir'
+require 'objspace'
+require File.dirname(__FILE__) + '/../bench/support/mock_server'
 
 class TestStropheRuby < Test::Unit::TestCase
 
   def setup
+    StropheRuby::EventLoop.prepare
+    @ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+    @conn = StropheRuby::Connection.new(@ctx)
   end
   
   def test_truth
     assert true
   end
+
+  def test_accessors_are_memoized_until_set
+    stanza = StropheRuby::Stanza.new
+    stanza.name = "message"
+    stanza.type = "chat"
+    stanza.set_attribute("from", "alice@example.com")
+
+    assert_same stanza.name, stanza.name
+    assert_same stanza.type, stanza.attribute("type")
+    assert_same stanza.attribute("from"), stanza.attribute("from")
+    assert stanza.attribute("from").frozen?
+
+    stanza.set_attribute("from", "bob@example.com")
+    assert_equal "bob@example.com", stanza.attribute("from")
+    stanza.type = "normal"
+    assert_equal "normal", stanza.type
+    assert_nil stanza.id
+
+    body = StropheRuby::Stanza.new
+    body.name = "body"
+    stanza.add_child(body)
+    first, second = stanza.child_by_name("body"), stanza.child_by_name("body")
+    assert_equal "body", first.name
+    assert_nil first.attribute("to")
+    second.name = "subject"
+    second.set_attribute("to", "carol@example.com")
+    assert_equal "subject", first.name
+    assert_equal "carol@example.com", first.attribute("to")
+  end
+
+  def test_bulk_attribute_extraction
+    message = StropheRuby::Stanza.new
+    message.name = "message"
+    message.set_attribute("from", "alice@example.com")
+    message.set_attribute("to", "bob@example.com")
+    body = StropheRuby::Stanza.new
+    body.name = "body"
+    text = StropheRuby::Stanza.new
+    text.text = "hi"
+    body.add_child(text)
+    message.add_child(body)
+
+    assert_equal({"from" => "alice@example.com", "to" => "bob@example.com"}, message.attributes)
+    assert_equal ["bob@example.com", nil], message.values_at("to", "id")
+    assert_equal({"name" => "message", "attributes" => message.attributes, "text" => "",
+                  "children" => [{"name" => "body", "attributes" => {}, "text" => "hi", "children" => ["hi"]}]},
+                 message.to_h(:deep => true))
+    assert_equal({"name" => "body", "attributes" => {}, "text" => "hi", "children" => nil}, body.to_h)
+    assert_equal message.to_h(:deep => true).keys, message.to_h.keys
+  end
+
+  def test_path_queries
+    iq = StropheRuby::Stanza.new
+    iq.name = "iq"
+    query = StropheRuby::Stanza.new
+    query.name = "query"
+    query.ns = "jabber:iq:roster"
+    %w[alice@example.com bob@example.com].each do |jid|
+      item = StropheRuby::Stanza.new
+      item.name = "item"
+      item.set_attribute("jid", jid)
+      query.add_child(item)
+    end
+    iq.add_child(query)
+
+    jids = StropheRuby::Path.compile("query[@xmlns='jabber:iq:roster']/item/@jid")
+    assert_equal ["alice@example.com", "bob@example.com"], jids.all(iq)
+    assert_equal "alice@example.com", iq.at(jids)
+    assert_equal 2, iq.query("query/item").size
+    assert_equal "item", iq.at("*/item[@jid='bob@example.com']").name
+    assert_nil iq.at("query[@xmlns='jabber:x:data']/item")
+    assert_raise(ArgumentError) { StropheRuby::Path.compile("query[jid]") }
+  end
+
+  def test_child_iteration
+    query = StropheRuby::Stanza.new
+    query.name = "query"
+    3.times do |i|
+      item = StropheRuby::Stanza.new
+      item.name = i.zero? ? "group" : "item"
+      nested = StropheRuby::Stanza.new
+      nested.name = "nested"
+      item.add_child(nested)
+      query.add_child(item)
+    end
+
+    assert_equal %w[group item item], query.each_child.map { |c| c.name }
+    assert_equal 2, query.each_child(:name => "item").count
+    assert_nil query.children.next.next.next
+    assert_equal %w[group nested item nested item nested], query.each_element.map { |e| e.name }
+    pruned = []
+    query.each_element { |e| pruned << e.name; :prune if e.name == "group" }
+    assert_equal %w[group item nested item nested], pruned
+  end
+
+  def test_serialization
+    message = StropheRuby::Stanza.new
+    message.name = "message"
+    message.set_attribute("to", "a&b@example.com")
+    body = StropheRuby::Stanza.new
+    body.name = "body"
+    text = StropheRuby::Stanza.new
+    text.text = "1 < 2 \"quoted\""
+    body.add_child(text)
+    message.add_child(body)
+
+    xml = %q{<message to="a&amp;b@example.com"><body>1 &lt; 2 &quot;quoted&quot;</body></message>}
+    assert_equal xml, message.to_s
+    buf = "log: "
+    assert_same buf, message.write_to(buf)
+    assert_equal "log: " + xml, buf
+    assert_equal "", StropheRuby::Stanza.new.to_s
+  end
+
+  def test_feed_merges_text_chunks
+    bodies = []
+    @conn.add_handler("message") { |msg| bodies << msg.child_by_name("body") }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message><body>hello")
+    @conn.feed(" wor")
+    @conn.feed("ld &amp; more</body></message>")
+
+    assert_equal 1, bodies.size
+    assert_equal "hello world & more", bodies.first.children.text
+    assert_nil bodies.first.children.next
+  end
+
+  def test_raw_handlers_get_the_serialized_stanza
+    raws = []
+    @conn.add_handler("message", :raw => true) { |raw| raws << raw }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message type='chat' from='a@example.com'><body>hel")
+    @conn.feed("lo</body></message><message/>")
+
+    assert_equal 2, raws.size
+    assert_equal "<message type='chat' from='a@example.com'><body>hello</body></message>", raws[0].xml
+    assert_equal ["message", "chat", "a@example.com"], [raws[0].name, raws[0].type, raws[0].from]
+    assert_equal "<message/>", raws[1].xml
+  end
+
+  def test_raw_start_tags_split_across_chunks
+    raws = []
+    @conn.add_handler("message", :raw => true) { |raw| raws << raw }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message type='chat' fr")
+    @conn.feed("om='a@example.com'><body>hi</body></message><mess")
+    @conn.feed("age/>")
+
+    assert_equal ["<message type='chat' from='a@example.com'><body>hi</body></message>", "<message/>"],
+                 raws.map(&:xml)
+    assert_equal "a@example.com", raws[0].from
+  end
+
+  def test_stanza_parse
+    msg = StropheRuby::Stanza.parse("<message to='a@example.com'><body>1 &lt; 2</body></message>")
+    assert_equal "message", msg.name
+    assert_equal "a@example.com", msg.attribute("to")
+    assert_equal "1 < 2", msg.child_by_name("body").text
+    assert_raise(ArgumentError) { StropheRuby::Stanza.parse("<message><body>") }
+    assert_raise(ArgumentError) { StropheRuby::Stanza.parse("<message></iq>") }
+    assert_equal "iq", StropheRuby::Stanza.parse("<iq/>").name
+  end
+
+  def test_stream_parser_feed
+    parser = StropheRuby::StreamParser.new
+    names = []
+    parser.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'><mess")
+    parser.feed("age><body>hi</body></message><presence/><iq") { |stanza| names << stanza.name }
+    assert_equal ["message", "presence"], names
+
+    big = "<message><body>" + "x" * 100_000 + "</body></message>"
+    stanzas = parser.feed("/>" + big)
+    assert_equal ["iq", "message"], stanzas.map { |stanza| stanza.name }
+    assert_equal 100_000, stanzas.last.child_by_name("body").text.size
+
+    bare = StropheRuby::StreamParser.new(nil, :stream => false)
+    assert_equal 3, bare.feed("<a/><b/><c/>").size
+  end
+
+  def test_stream_restarts_reuse_the_parser
+    parser = StropheRuby::StreamParser.new(@ctx)
+    before = @ctx.parser_pool_stats
+    2.times do
+      parser.reset
+      assert_equal 1, parser.feed("<stream:stream xmlns:stream='http://etherx.jabber.org/streams'><iq/>").size
+    end
+    after = @ctx.parser_pool_stats
+    assert_equal before[:created], after[:created]
+    assert_equal before[:resets] + 2, after[:resets]
+  end
+
+  def test_reset_frees_a_half_parsed_stanza
+    parser = StropheRuby::StreamParser.new(@ctx, :stream => false)
+    before = @ctx.memory_stats[:categories][:stanza][:bytes]
+    live = @ctx.memory_stats[:live_stanzas]
+    assert_equal [], parser.feed("<message><body>x")
+    parser.reset
+    assert_equal before, @ctx.memory_stats[:categories][:stanza][:bytes]
+    assert_equal live, @ctx.memory_stats[:live_stanzas]
+    assert_equal ["iq"], parser.feed("<iq/>").map { |stanza| stanza.name }
+  end
+
+  def test_stanzas_over_a_limit_are_dropped
+    names = []
+    @conn.add_handler("message") { |msg| names << msg.attribute("id") }
+    @conn.limits = {:depth => 3, :children => 2, :attributes => 2, :bytes => 200, :action => :drop}
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message id='1'><a><b><c/></b></a></message>")
+    @conn.feed("<message id='2'><a/><b/><c/></message>")
+    @conn.feed("<message id='3' a='1' b='2'/>")
+    @conn.feed("<message id='4'><body>" + "x" * 300 + "</body></message>")
+    @conn.feed("<message id='5'><a><b/></a><body>ok</body></message>")
+
+    assert_equal ["5"], names
+    assert_equal({:bytes => 1, :depth => 1, :children => 1, :attributes => 1}, @conn.limit_hits)
+    assert_equal :drop, @conn.limits[:action]
+  end
+
+  def test_stanza_over_a_limit_aborts_the_stream
+    @conn.limits = {:bytes => 100}
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message><body>")
+    assert_raise(ArgumentError) { @conn.feed("x" * 200) }
+    assert_equal 1, @conn.limit_hits[:bytes]
+  end
+
+  def test_native_memory_is_visible_to_the_gc
+    ctx_size = ObjectSpace.memsize_of(@ctx)
+    small = StropheRuby::Stanza.parse("<message/>", @ctx)
+    large = StropheRuby::Stanza.parse("<message><body>#{"x" * 100_000}</body></message>", @ctx)
+    assert ObjectSpace.memsize_of(large) > ObjectSpace.memsize_of(small) + 100_000
+    # the tree is reported by its wrapper only, not by the context too
+    assert ObjectSpace.memsize_of(@ctx) < ctx_size + 100_000
+    assert @ctx.memory_stats[:bytes] > 100_000
+  end
+
+  def test_handlers_belong_to_their_connection
+    other = StropheRuby::Connection.new(@ctx)
+    seen = []
+    @conn.add_handler("message") { |msg| seen << [:first, msg.id] }
+    other.add_handler("message") { |msg| seen << [:other, msg.id] }
+    GC.start
+    stream = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+    @conn.feed(stream).feed("<message id='1'/>")
+    other.feed(stream).feed("<message id='2'/>")
+    @conn.clone.feed("<message id='3'/>")
+    assert_equal [[:first, "1"], [:other, "2"], [:first, "3"]], seen
+    assert_equal "", StropheRuby::Stanza.new(@ctx).to_s
+  end
+
+  def test_handlers_for_different_kinds_all_fire
+    seen = []
+    @conn.add_handler("message") { |msg| seen << [:message, msg.id] }
+    @conn.add_handler("presence") { |pres| seen << [:presence, pres.id] }
+    @conn.add_handler("iq") { |iq| seen << [:iq, iq.id] }
+    @conn.add_handler("message", :type => "chat") { |msg| seen << [:chat, msg.id] }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    @conn.feed("<message id='1' type='chat'/><presence id='2'/><iq id='3' type='get'/><message id='4'/>")
+    assert_equal [[:message, "1"], [:chat, "1"], [:presence, "2"], [:iq, "3"], [:message, "4"]], seen
+  end
+
+  def test_handlers_can_be_removed
+    stream = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+    seen = []
+    chat = @conn.add_handler("message", :type => "chat") { |msg| seen << [:chat, msg.id] }
+    once = @conn.add_handler("message", :once => true) { |msg| seen << [:once, msg.id] }
+    quitter = @conn.add_handler("message") { |msg| seen << [:quitter, msg.id]; quitter.remove }
+    answer = @conn.add_id_handler("q1") { |iq| seen << [:answer, iq.id] }
+    @conn.feed(stream).feed("<message id='1' type='chat'/><iq id='q2' type='result'/><iq id='q1' type='result'/>")
+    @conn.feed("<message id='2' type='chat'/>")
+    assert_equal [[:chat, "1"], [:once, "1"], [:quitter, "1"], [:answer, "q1"], [:chat, "2"]], seen
+    assert once.removed? && quitter.removed?
+    assert !quitter.remove
+    assert chat.remove && answer.remove
+    assert_equal [], @conn.handler_stats
+    @conn.feed("<message id='3' type='chat'/><iq id='q1' type='result'/>")
+    assert_equal 5, seen.size
+  end
+
+  def test_removed_handlers_give_their_native_memory_back
+    cycle = lambda do |i|
+      @conn.add_handler("message", :type => "chat") { |msg| }.remove
+      @conn.add_id_handler("q#{i}") { |iq| }.remove
+    end
+    cycle.call(0)
+    before = @ctx.memory_stats[:categories].values_at(:handler, :hash).map { |category| category[:bytes] }
+    1.upto(50) { |i| cycle.call(i) }
+    assert_equal before, @ctx.memory_stats[:categories].values_at(:handler, :hash).map { |category| category[:bytes] }
+  end
+
+  def test_connection_stats
+    @conn.add_handler("message") { |msg| }
+    stream = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+    chunk = "<message type='chat'/><message type='chat'/><presence/>"
+    @conn.feed(stream).feed(chunk)
+    stats = @conn.stats
+    assert_equal stream.bytesize + chunk.bytesize, stats[:bytes_read]
+    assert_equal 3, stats[:stanzas_in]
+    assert_equal({:in => 2, :out => 0}, stats[:stanzas][["message", "chat"]])
+    assert_equal({:in => 1, :out => 0}, stats[:stanzas][["presence", nil]])
+    assert_equal 2, stats[:handler_time][:count]
+    assert stats[:dispatch_latency][:p99] >= stats[:dispatch_latency][:p50]
+    assert_equal 0, stats[:reconnects]
+
+    assert_equal 3, @ctx.stats[:stanzas_in]
+    text = @ctx.prometheus
+    assert_match(/^strophe_ruby_stanzas_in_total\{conn="\d+",jid="",name="message",type="chat"\} 2$/, text)
+    assert_match(/^# TYPE strophe_ruby_handler_seconds summary$/, text)
+  end
+
+  def test_logs_go_to_a_block_or_a_file
+    over_limit = lambda do |ctx|
+      conn = StropheRuby::Connection.new(ctx)
+      conn.limits = {:bytes => 20, :action => :drop}
+      conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+      conn.feed("<message><body>#{"x" * 50}</body></message>")
+    end
+
+    lines = []
+    ctx = StropheRuby::Context.new(StropheRuby::Logging::WARN) { |level, area, msg| lines << [level, area, msg] }
+    over_limit.call(ctx)
+    assert ctx.flush_log
+    assert_equal 1, lines.size
+    assert_equal [StropheRuby::Logging::WARN, "xmpp"], lines.first[0, 2]
+    assert_match(/over the bytes limit/, lines.first[2])
+    assert_equal({:written => 1, :dropped => 0, :truncated => 0}, ctx.log_stats)
+
+    path = File.join(Dir.tmpdir, "strophe_ruby_test_#{$$}.log")
+    begin
+      ctx = StropheRuby::Context.new(StropheRuby::Logging::WARN, path)
+      over_limit.call(ctx)
+      assert ctx.flush_log
+      assert_match(/\Axmpp WARN stanza over the bytes limit/, File.read(path))
+    ensure
+      File.delete(path) if File.exist?(path)
+    end
+
+    over_limit.call(@ctx)
+    assert_equal 0, @ctx.log_stats[:written]
+  end
+
+  def test_slow_handlers_are_reported_with_their_source
+    slow = []
+    @conn.add_handler("message") { |msg| }
+    line = __LINE__ + 1
+    @conn.add_handler("message") { |msg| sleep 0.02 }
+    @conn.slow_handler_threshold = 0.01
+    @conn.on_slow_handler { |handler, seconds| slow << [handler.kind, handler.source, seconds] }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    2.times { @conn.feed("<message/>") }
+
+    assert_equal 2, slow.size
+    assert_equal ["message", "#{__FILE__}:#{line}"], slow.first[0, 2]
+    assert slow.first[2] >= 0.02
+    fast, sleepy = @conn.handler_stats
+    assert_equal [2, 0], [fast[:calls], fast[:slow]]
+    assert_equal [2, 2], [sleepy[:calls], sleepy[:slow]]
+    assert sleepy[:max] >= 0.02 && sleepy[:total] >= 0.04
+  end
+
+  def test_memory_stats_by_category
+    before = @ctx.memory_stats
+    msg = StropheRuby::Stanza.parse("<message to='bob@localhost'><body>#{"x" * 10_000}</body></message>", @ctx)
+    after = @ctx.memory_stats
+    assert after[:categories][:stanza][:bytes] > before[:categories][:stanza][:bytes] + 10_000
+    assert after[:categories][:hash][:bytes] > before[:categories][:hash][:bytes]
+    assert_equal before[:live_stanzas] + 3, after[:live_stanzas]
+    assert after[:stanza_wrappers] > before[:stanza_wrappers]
+    assert after[:allocations] >= before[:allocations] + after[:live_stanzas] - before[:live_stanzas]
+    assert_equal [:other, :stanza, :send_queue, :parser, :handler, :hash].sort, after[:categories].keys.sort
+    conn = after[:connections].first
+    assert_equal [:jid, :parser_buffer_bytes, :send_queue_bytes], conn.keys.sort
+    assert msg.copy
+    assert_equal after[:live_stanzas] + 3, @ctx.memory_stats[:live_stanzas]
+  end
+
+  def test_added_children_outlive_their_parents_wrapper
+    GC.stress = true
+    children = Array.new(3) do |i|
+      parent = StropheRuby::Stanza.new(@ctx)
+      parent.name = "message"
+      child = StropheRuby::Stanza.new(@ctx)
+      child.name = "body"
+      text = StropheRuby::Stanza.new(@ctx)
+      text.text = "b#{i}"
+      child.add_child(text)
+      grandchild = child.children
+      parent.add_child(child)
+      [child, grandchild]
+    end
+    GC.start
+    children.each_with_index do |(child, grandchild), i|
+      assert_equal "body", child.clone.name
+      assert_equal "b#{i}", child.clone.children.text
+      assert_equal "b#{i}", grandchild.text
+    end
+    children.map!(&:last)
+    GC.start
+    children.each_with_index { |grandchild, i| assert_equal "b#{i}", grandchild.to_s }
+  ensure
+    GC.stress = false
+  end
+
+  def test_stanzas_outlive_a_freed_context
+    ctx = StropheRuby::Context.new(StropheRuby::Logging::ERROR)
+    msg = StropheRuby::Stanza.parse("<message><body>still here</body></message>", ctx)
+    ctx.free
+    assert_raise(ArgumentError) { ctx.loop_status }
+    GC.start
+    assert_equal "still here", msg.child_by_name("body").text
+  end
+
+  def test_retained_stanzas_and_children_stay_valid
+    kept = []
+    @conn.add_handler("message") { |msg| kept << msg }
+    @conn.feed("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>")
+    3.times { |i| @conn.feed("<message id='#{i}'><subject>s#{i}</subject><body>b#{i}</body></message>") }
+
+    subject = kept.last.child_by_name("subject")
+    kept.clear
+    GC.start
+    assert_equal "body", subject.next.name
+    assert_equal "b2", subject.next.text
+    assert_nil subject.clone.next.next
+  end
+
+  def test_logs_into_the_mock_server_and_gets_an_echo
+    port, server = MockServer.spawn
+    @conn.jid = "alice@localhost/test"
+    @conn.password = "secret"
+    up, echoed = false, nil
+    @conn.connect("127.0.0.1", port) { up = true }
+    @conn.add_handler("message") { |msg| echoed = msg }
+    deadline = Time.now + 10
+    StropheRuby::EventLoop.run_once(@ctx, 10) until up || Time.now > deadline
+    assert up
+
+    msg = StropheRuby::Stanza.new(@ctx)
+    msg.name = "message"
+    msg.id = "m1"
+    msg.set_attribute("to", "bob@localhost")
+    @conn.send(msg)
+    assert @conn.stats[:send_queue_peak_bytes] > 0
+    assert_equal msg.to_s.bytesize, @conn.stats[:bytes_written]
+    StropheRuby::EventLoop.run_once(@ctx, 10) until echoed || Time.now > deadline
+    assert_equal ["m1", "bob@localhost", "alice@localhost/test"], echoed.values_at("id", "from", "to")
+  ensure
+    server.close if server
+  end
+
+  def test_captured_traffic_replays_without_a_socket
+    port, server = MockServer.spawn
+    path = File.join(Dir.tmpdir, "strophe_ruby_capture_#{$$}")
+    @conn.jid = "alice@localhost/test"
+    @conn.password = "secret"
+    @conn.start_capture(path)
+    echoed = 0
+    @conn.add_handler("message") { |msg| echoed += 1 }
+    @conn.connect("127.0.0.1", port) { @conn.send_raw_string("<message to='bob@localhost' id='m1'/>") }
+    deadline = Time.now + 10
+    StropheRuby::EventLoop.run_once(@ctx, 10) until echoed == 1 || Time.now > deadline
+    captured = @conn.stop_capture
+    assert_equal 1, echoed
+    assert captured[:records] > 4
+
+    replayed = []
+    conn = StropheRuby::Connection.new(@ctx)
+    conn.add_handler("message") { |msg| replayed << msg.id }
+    result = conn.replay(path)
+    assert_equal ["m1"], replayed
+    assert result[:bytes_in] > 0 && result[:bytes_out] > 0
+    assert_equal captured[:bytes], result[:bytes_in] + result[:bytes_out]
+  ensure
+    server.close if server
+    File.unlink(path) if path && File.exist?(path)
+  end
+
+  def test_connect_block_hears_about_disconnects
+    port, server = MockServer.spawn
+    statuses = []
+    @conn.jid = "alice@localhost/test"
+    @conn.password = "secret"
+    @conn.connect("127.0.0.1", port) { |status| statuses << status }
+    deadline = Time.now + 10
+    StropheRuby::EventLoop.run_once(@ctx, 10) until statuses.size == 1 || Time.now > deadline
+    server.close
+    server = nil
+    StropheRuby::EventLoop.run_once(@ctx, 10) until statuses.size == 2 || Time.now > deadline
+    assert_equal [StropheRuby::ConnectionEvents::CONNECT, StropheRuby::ConnectionEvents::DISCONNECT], statuses
+  ensure
+    server.close if server
+  end
+
+  def test_reading_text_does_not_leak
+    body = StropheRuby::Stanza.parse("<body>#{"x" * 1000}</body>", @ctx)
+    body.text
+    before = @ctx.memory_stats[:bytes]
+    100.times { assert_equal 1000, body.text.size }
+    assert_equal before, @ctx.memory_stats[:bytes]
+  end
 end
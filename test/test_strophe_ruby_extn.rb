@@ -1,9 +1,25 @@
 require "test/unit"
 
 $:.unshift File.dirname(__FILE__) + "/../ext/strophe_ruby"
+require "strophe_ruby.so"
 
 class TestStropheRubyExtn < Test::Unit::TestCase
   def test_truth
     assert true
   end
+
+  # every vector kernel must agree with the scalar one, whatever the alignment
+  # and wherever the special characters fall
+  def test_escape_kernels_match_scalar
+    alphabet = %w[a b c & < > " ' x y z] + ["é"]
+    srand(4242)
+    2000.times do
+      input = Array.new(rand(200)) { alphabet[rand(alphabet.size)] }.join
+      expected = input.gsub("&", "&amp;").gsub("<", "&lt;").gsub(">", "&gt;").gsub('"', "&quot;")
+      assert_equal expected, StropheRuby::XML.escape(input, :kernel => :scalar)
+      StropheRuby::XML.kernels.each do |kernel|
+        assert_equal expected, StropheRuby::XML.escape(input, :kernel => kernel), "kernel #{kernel}"
+      end
+    end
+  end
 end